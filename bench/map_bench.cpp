@@ -0,0 +1,715 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bsp_file.h"
+#include "hash.h"
+#include "map_file.h"
+#include "map_generator.h"
+
+// Counts every allocation made through global operator new, including the ones made by the
+// parser's worker threads.
+static std::atomic<std::uint64_t> g_alloc_count{ 0 };
+static std::atomic<std::uint64_t> g_alloc_bytes{ 0 };
+
+void* operator new(std::size_t size)
+{
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+
+struct AllocStats
+{
+    AllocStats() : count(g_alloc_count.load()), bytes(g_alloc_bytes.load()) {}
+
+    std::uint64_t count;
+    std::uint64_t bytes;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double Seconds(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct Timings
+{
+    void Add(double seconds) { _samples.push_back(seconds); }
+
+    double Best() const { return *std::min_element(_samples.begin(), _samples.end()); }
+
+    double Median() const
+    {
+        std::vector<double> sorted = _samples;
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[sorted.size() / 2];
+    }
+
+    std::vector<double> _samples;
+};
+
+// Stand-ins for the per-config lists, so the light and entity content paths do real filtering.
+const std::vector<std::string> CUSTOM_WORLDSPAWN_LIGHT_FIELDS = { "_sun2", "_sun2_color" };
+const std::vector<std::string> CUSTOM_BRUSH_LIGHT_FIELDS = { "_lightignore" };
+const std::vector<std::string> CUSTOM_LIGHT_ENTITIES = { "light_torch_small_walltorch", "light_flame_large_yellow" };
+const std::vector<std::string> IGNORE_FIELD_DIFF = { "_tb_textures", "_tb_mod" };
+
+map_file::MapDiffOptions GetDiffOptions(double brush_epsilon)
+{
+    map_file::MapDiffOptions options;
+    options.custom_worldspawn_light_fields = CUSTOM_WORLDSPAWN_LIGHT_FIELDS;
+    options.custom_brush_light_fields = CUSTOM_BRUSH_LIGHT_FIELDS;
+    options.custom_light_entities = CUSTOM_LIGHT_ENTITIES;
+    options.ignore_field_diff = IGNORE_FIELD_DIFF;
+    options.brush_epsilon = brush_epsilon;
+    options.Build();
+    return options;
+}
+
+bool WriteFile(const std::string& path, const std::string& text)
+{
+    std::ofstream fh{ path, std::ios::binary };
+    fh.write(text.data(), text.size());
+    return fh.good();
+}
+
+std::string DiffFlagsString(map_file::MapDiffFlags flags)
+{
+    std::string str;
+    if (flags & map_file::MAP_DIFF_BRUSHES) str += "brushes ";
+    if (flags & map_file::MAP_DIFF_TEXTURES) str += "textures ";
+    if (flags & map_file::MAP_DIFF_ENTS) str += "ents ";
+    if (flags & map_file::MAP_DIFF_LIGHTS) str += "lights ";
+    if (str.empty()) str = "none ";
+    str.pop_back();
+    return str;
+}
+
+void PrintTiming(const char* name, const Timings& timings, std::size_t bytes)
+{
+    if (bytes) {
+        std::printf("  %-22s best %9.3f ms  median %9.3f ms  %8.1f MB/s\n", name,
+            timings.Best() * 1000.0, timings.Median() * 1000.0, bytes / timings.Best() / (1024.0 * 1024.0));
+    }
+    else {
+        std::printf("  %-22s best %9.3f ms  median %9.3f ms\n", name, timings.Best() * 1000.0, timings.Median() * 1000.0);
+    }
+}
+
+void BenchParse(const std::string& path, std::size_t size, int iterations)
+{
+    std::printf("parse\n");
+
+    {
+        AllocStats before;
+        map_file::MapFile map{ path };
+        AllocStats after;
+        std::printf("  %-22s %zu entities, %zu fields, %llu allocations, %.1f MB allocated\n", "MapFile",
+            map._entities.size(), map._fields.size(),
+            (unsigned long long)(after.count - before.count), (after.bytes - before.bytes) / (1024.0 * 1024.0));
+    }
+
+    Timings load;
+    for (int i = 0; i < iterations; i++) {
+        auto start = Clock::now();
+        map_file::MapFile map{ path };
+        load.Add(Seconds(start));
+    }
+    PrintTiming("MapFile", load, size);
+
+    Timings stream;
+    for (int i = 0; i < iterations; i++) {
+        map_file::MapVisitor visitor;
+        auto start = Clock::now();
+        map_file::StreamMapFile(path, visitor);
+        stream.Add(Seconds(start));
+    }
+    PrintTiming("StreamMapFile", stream, size);
+
+    Timings layers;
+    for (int i = 0; i < iterations; i++) {
+        std::vector<map_file::MapLayer> result;
+        auto start = Clock::now();
+        map_file::ReadMapLayers(path, result);
+        layers.Add(Seconds(start));
+    }
+    PrintTiming("ReadMapLayers", layers, size);
+}
+
+void BenchContent(const std::string& path, int iterations)
+{
+    std::printf("content\n");
+
+    map_file::MapFile map{ path };
+    Timings brushes, ents, lights;
+    for (int i = 0; i < iterations; i++) {
+        auto start = Clock::now();
+        std::string content = map.GetBrushContent();
+        brushes.Add(Seconds(start));
+
+        start = Clock::now();
+        content = map.GetEntityContent(IGNORE_FIELD_DIFF);
+        ents.Add(Seconds(start));
+
+        start = Clock::now();
+        content = map.GetLightContent(CUSTOM_WORLDSPAWN_LIGHT_FIELDS, CUSTOM_BRUSH_LIGHT_FIELDS, CUSTOM_LIGHT_ENTITIES, IGNORE_FIELD_DIFF);
+        lights.Add(Seconds(start));
+    }
+    PrintTiming("GetBrushContent", brushes, 0);
+    PrintTiming("GetEntityContent", ents, 0);
+    PrintTiming("GetLightContent", lights, 0);
+
+    // Fresh maps, so nothing is cached. Brush hashing dominates both.
+    Timings raw, canonical;
+    for (int i = 0; i < iterations; i++) {
+        map_file::MapFile fresh{ path };
+        auto start = Clock::now();
+        fresh.GetDigests(GetDiffOptions(-1.0));
+        raw.Add(Seconds(start));
+
+        map_file::MapFile fresh2{ path };
+        start = Clock::now();
+        fresh2.GetDigests(GetDiffOptions(map_file::DEFAULT_BRUSH_EPSILON));
+        canonical.Add(Seconds(start));
+    }
+    PrintTiming("GetDigests raw", raw, 0);
+    PrintTiming("GetDigests canonical", canonical, 0);
+
+    Timings geometry;
+    for (int i = 0; i < iterations; i++) {
+        map_file::MapFile fresh{ path };
+        auto start = Clock::now();
+        fresh.GetGeometry();
+        geometry.Add(Seconds(start));
+    }
+    PrintTiming("GetGeometry", geometry, 0);
+
+    // The first lookup counts the lines of the whole map.
+    Timings location;
+    for (int i = 0; i < iterations; i++) {
+        map_file::MapFile fresh{ path };
+        map_file::MapLocation loc;
+        auto start = Clock::now();
+        fresh.FindEntityLocation(fresh._entities.size() - 1, loc);
+        location.Add(Seconds(start));
+    }
+    PrintTiming("FindEntityLocation", location, 0);
+}
+
+/// Times what a file change costs in watch mode: loading the saved map and diffing it against
+/// the one from the previous compile, comparing brush text as is and canonicalized.
+void BenchDiff(const char* name, const std::string& base_path, const std::string& edited_path, int iterations)
+{
+    map_file::MapFile base{ base_path };
+    for (double epsilon : { -1.0, map_file::DEFAULT_BRUSH_EPSILON }) {
+        map_file::MapDiffOptions options = GetDiffOptions(epsilon);
+        Timings load, diff, change_set;
+        map_file::MapDiffFlags flags = map_file::MAP_DIFF_NONE;
+        std::size_t modified = 0;
+        for (int i = 0; i < iterations; i++) {
+            auto start = Clock::now();
+            map_file::MapFile edited{ edited_path };
+            load.Add(Seconds(start));
+
+            start = Clock::now();
+            flags = map_file::GetDiffFlags(base, edited, options);
+            diff.Add(Seconds(start));
+
+            // Fingerprints are cached by now, this is the cost of matching the entities.
+            start = Clock::now();
+            auto changes = map_file::GetChangeSet(base, edited, options);
+            change_set.Add(Seconds(start));
+            modified = changes.modified.size();
+        }
+        std::printf("  %s, %s brushes -> %s, %zu modified entities\n", name, epsilon < 0.0 ? "raw" : "canonical",
+            DiffFlagsString(flags).c_str(), modified);
+        PrintTiming("  load", load, 0);
+        PrintTiming("  GetDiffFlags", diff, 0);
+        PrintTiming("  GetChangeSet", change_set, 0);
+    }
+}
+
+/// Writes the entities of a map the way qbsp writes them into the entity lump, brushes replaced by model numbers.
+struct EntityLumpWriter : map_file::MapVisitor
+{
+    void EntityBegin() override
+    {
+        _lump.append("{\n");
+        _brushes = 0;
+    }
+
+    void Field(std::string_view key, std::string_view value) override
+    {
+        _lump.append("\"").append(key).append("\" \"").append(value).append("\"\n");
+    }
+
+    void Brush(std::string_view) override { _brushes++; }
+
+    void EntityEnd() override
+    {
+        if (_brushes && _models++) {
+            _lump.append("\"model\" \"*" + std::to_string(_models - 1) + "\"\n");
+        }
+        _lump.append("}\n");
+    }
+
+    std::string _lump;
+    std::size_t _brushes = 0;
+    std::size_t _models = 0;
+};
+
+/// A BSP29 file with the entity lump of the map and zeroes standing in for the other lumps.
+bool WriteBsp(const std::string& path, const std::string& map_path)
+{
+    EntityLumpWriter writer;
+    if (!map_file::StreamMapFile(map_path, writer)) {
+        return false;
+    }
+
+    static constexpr std::size_t NUM_LUMPS = 15;
+    static constexpr std::size_t OTHER_LUMPS_SIZE = 16 * 1024 * 1024;
+    std::int32_t header[1 + NUM_LUMPS * 2] = {};
+    header[0] = 29;
+    header[1] = static_cast<std::int32_t>(sizeof(header) + OTHER_LUMPS_SIZE);
+    header[2] = static_cast<std::int32_t>(writer._lump.size() + 1);
+
+    std::string bsp(reinterpret_cast<const char*>(header), sizeof(header));
+    bsp.append(OTHER_LUMPS_SIZE, '\0');
+    bsp.append(writer._lump);
+    bsp.push_back('\0');
+    return WriteFile(path, bsp);
+}
+
+/// Times the cold start of watch mode: deciding what to rebuild from the digests stamped into the entity
+/// lump of the output BSP after the last successful compile, without a snapshot of it.
+void BenchBsp(const std::string& base_path, const std::vector<std::pair<const char*, std::string>>& edits, int iterations)
+{
+    std::printf("bsp\n");
+
+    namespace fs = std::filesystem;
+    const std::string work_path = (fs::temp_directory_path() / "map_bench_work.map").string();
+    const std::string bsp_path = (fs::temp_directory_path() / "map_bench_work.bsp").string();
+
+    map_file::MapDiffOptions options = GetDiffOptions(map_file::DEFAULT_BRUSH_EPSILON);
+    map_file::MapFile base{ base_path };
+    auto base_digests = base.GetDigests(options);
+    if (!map_file::WriteWorkMap(base, nullptr, nullptr, work_path) || !WriteBsp(bsp_path, work_path)) {
+        std::fprintf(stderr, "map_bench: couldn't write %s\n", bsp_path.c_str());
+        return;
+    }
+
+    Timings stamp, read;
+    for (int i = 0; i < iterations; i++) {
+        auto start = Clock::now();
+        bsp_file::WriteMapDigests(bsp_path, base_digests);
+        stamp.Add(Seconds(start));
+    }
+    PrintTiming("WriteMapDigests", stamp, 0);
+
+    map_file::MapDigests bsp_digests;
+    for (int i = 0; i < iterations; i++) {
+        auto start = Clock::now();
+        bsp_file::ReadMapDigests(bsp_path, bsp_digests);
+        read.Add(Seconds(start));
+    }
+    PrintTiming("ReadMapDigests", read, 0);
+
+    for (const auto& edit : edits) {
+        map_file::MapFile edited{ edit.second };
+        auto flags = map_file::GetDiffFlags(bsp_digests, edited.GetDigests(options));
+        std::printf("  cold start, %s -> %s\n", edit.first, DiffFlagsString(flags).c_str());
+    }
+
+    // What replaces qbsp -onlyents for a point entity edit.
+    map_file::MapFile edited{ edits.front().second };
+    auto edited_digests = edited.GetDigests(options);
+    Timings make, write;
+    std::string lump;
+    for (int i = 0; i < iterations; i++) {
+        auto start = Clock::now();
+        bsp_file::MakeEntityLump(edited, nullptr, lump);
+        make.Add(Seconds(start));
+
+        start = Clock::now();
+        bsp_file::WriteEntityLump(bsp_path, lump);
+        write.Add(Seconds(start));
+    }
+    bsp_file::WriteMapDigests(bsp_path, edited_digests);
+    PrintTiming("MakeEntityLump", make, 0);
+    PrintTiming("WriteEntityLump", write, 0);
+    bsp_file::ReadMapDigests(bsp_path, bsp_digests);
+    std::printf("  patched lump digests %s\n", map_file::GetDiffFlags(bsp_digests, edited_digests) == map_file::MAP_DIFF_NONE ? "match" : "DIFFER");
+
+    std::error_code ec;
+    fs::remove(work_path, ec);
+    fs::remove(bsp_path, ec);
+}
+
+/// Times writing the work map, whole and for a selection of layers, and diffs a worldspawn brush
+/// edit as each selection sees it.
+void BenchStaging(const std::string& base_path, const std::string& brush_path, int iterations)
+{
+    std::printf("staging\n");
+
+    namespace fs = std::filesystem;
+    const std::string work_path = (fs::temp_directory_path() / "map_bench_stage.map").string();
+
+    map_file::MapFile base{ base_path };
+    map_file::MapFile edited{ brush_path };
+    auto options = GetDiffOptions(map_file::DEFAULT_BRUSH_EPSILON);
+    std::vector<std::string> two_layers = { "Layer 1", "Layer 2" };
+
+    struct Stage
+    {
+        const char* name;
+        bool filtered;
+        bool default_layer;
+    };
+    for (const Stage& stage : { Stage{ "whole map", false, true }, Stage{ "2 layers + default", true, true }, Stage{ "2 layers", true, false } }) {
+        Timings filter, digest, write;
+        map_file::MapLayerFilter layer_filter;
+        map_file::MapDigests digests;
+        for (int i = 0; i < iterations; i++) {
+            auto start = Clock::now();
+            if (stage.filtered) {
+                layer_filter = map_file::FilterMapLayers(base, two_layers, stage.default_layer);
+            }
+            filter.Add(Seconds(start));
+
+            start = Clock::now();
+            digests = base.GetDigests(options, stage.filtered ? &layer_filter : nullptr);
+            digest.Add(Seconds(start));
+
+            start = Clock::now();
+            map_file::WriteWorkMap(base, &digests, stage.filtered ? &layer_filter : nullptr, work_path);
+            write.Add(Seconds(start));
+        }
+
+        map_file::MapLayerFilter edited_filter;
+        if (stage.filtered) {
+            edited_filter = map_file::FilterMapLayers(edited, two_layers, stage.default_layer);
+        }
+        auto flags = map_file::GetDiffFlags(digests, edited.GetDigests(options, stage.filtered ? &edited_filter : nullptr));
+
+        map_file::MapFile staged{ work_path };
+        std::printf("  %s: %zu entities, %.1f MB, brush edit: %s\n", stage.name, staged._entities.size(),
+            staged._text.size() / (1024.0 * 1024.0), DiffFlagsString(flags).c_str());
+        if (stage.filtered) {
+            PrintTiming("  FilterMapLayers", filter, 0);
+        }
+        PrintTiming("  GetDigests", digest, 0);
+        PrintTiming("  WriteWorkMap", write, staged._text.size());
+    }
+
+    std::error_code ec;
+    fs::remove(work_path, ec);
+}
+
+/// Times staging three layer variants from one parse of the map, one after the other and on a
+/// thread each as the layer variants job does.
+void BenchVariants(const std::string& base_path, int iterations)
+{
+    std::printf("layer variants\n");
+
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path();
+    std::vector<std::string> two_layers = { "Layer 1", "Layer 2" };
+    std::vector<std::string> all_layers = { "Layer 1", "Layer 2", "Layer 3", "Layer 4" };
+
+    struct Variant
+    {
+        std::string path;
+        map_file::MapLayerFilter filter;
+    };
+    map_file::MapFile base{ base_path };
+    auto options = GetDiffOptions(map_file::DEFAULT_BRUSH_EPSILON);
+    base.GetFingerprints(options);
+    std::vector<Variant> variants = {
+        { (dir / "map_bench_variant_full.map").string(), map_file::FilterMapLayers(base, all_layers, true) },
+        { (dir / "map_bench_variant_detail.map").string(), map_file::FilterMapLayers(base, two_layers, true) },
+        { (dir / "map_bench_variant_gameplay.map").string(), map_file::FilterMapLayers(base, two_layers, false) },
+    };
+
+    auto stage = [&base, &options](const Variant& variant) {
+        auto digests = base.GetDigests(options, &variant.filter);
+        map_file::WriteWorkMap(base, &digests, &variant.filter, variant.path);
+    };
+
+    Timings serial, parallel;
+    for (int i = 0; i < iterations; i++) {
+        auto start = Clock::now();
+        for (const auto& variant : variants) {
+            stage(variant);
+        }
+        serial.Add(Seconds(start));
+
+        start = Clock::now();
+        std::vector<std::thread> threads;
+        for (const auto& variant : variants) {
+            threads.emplace_back(stage, std::cref(variant));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        parallel.Add(Seconds(start));
+    }
+    PrintTiming("  serial", serial, 0);
+    PrintTiming("  thread per variant", parallel, 0);
+
+    std::error_code ec;
+    for (const auto& variant : variants) {
+        fs::remove(variant.path, ec);
+    }
+}
+
+/// Times a region compile's staging of a box in the middle of the map: the brush bounds, picking
+/// what's in the box and writing it sealed.
+void BenchRegion(const std::string& base_path, int iterations)
+{
+    std::printf("region\n");
+
+    namespace fs = std::filesystem;
+    const std::string work_path = (fs::temp_directory_path() / "map_bench_region.map").string();
+
+    map_file::MapFile base{ base_path };
+    const map_file::MapBounds box{ { -1024, -1024, -1024 }, { 1024, 1024, 1024 } };
+
+    Timings geometry, filter, write;
+    map_file::MapRegion region;
+    for (int i = 0; i < iterations; i++) {
+        // the geometry is decoded once per map, a fresh parse shows what the first region costs
+        map_file::MapFile map{ base_path };
+        auto start = Clock::now();
+        map.GetGeometry();
+        geometry.Add(Seconds(start));
+
+        start = Clock::now();
+        region = map_file::FilterMapRegion(map, box, nullptr);
+        filter.Add(Seconds(start));
+
+        start = Clock::now();
+        map_file::WriteRegionMap(map, region, work_path);
+        write.Add(Seconds(start));
+    }
+
+    map_file::MapFile staged{ work_path };
+    std::printf("  %zu of %zu entities, %zu of %zu brushes, %.1f MB\n", staged._entities.size(), base._entities.size(),
+        staged._brush_offsets.size(), base._brush_offsets.size(), staged._text.size() / (1024.0 * 1024.0));
+    PrintTiming("  GetGeometry", geometry, base._text.size());
+    PrintTiming("  FilterMapRegion", filter, 0);
+    PrintTiming("  WriteRegionMap", write, staged._text.size());
+
+    std::error_code ec;
+    fs::remove(work_path, ec);
+}
+
+/// Times staging the work map without the editor's metadata, and shows that renaming a group
+/// changes the plain work map but not the normalized one.
+void BenchNormalize(const std::string& base_path, int iterations)
+{
+    std::printf("normalize\n");
+
+    namespace fs = std::filesystem;
+    const std::string work_path = (fs::temp_directory_path() / "map_bench_normalize.map").string();
+    const std::string renamed_path = (fs::temp_directory_path() / "map_bench_renamed.map").string();
+
+    map_file::MapFile base{ base_path };
+    auto options = GetDiffOptions(map_file::DEFAULT_BRUSH_EPSILON);
+    auto digests = base.GetDigests(options);
+
+    Timings plain, normalized;
+    std::uint64_t base_hash = 0;
+    for (int i = 0; i < iterations; i++) {
+        auto start = Clock::now();
+        map_file::WriteWorkMap(base, &digests, nullptr, work_path);
+        plain.Add(Seconds(start));
+    }
+    std::size_t plain_size = map_file::MapFile{ work_path }._text.size();
+    for (int i = 0; i < iterations; i++) {
+        auto start = Clock::now();
+        map_file::WriteNormalizedMap(base, &digests, nullptr, work_path, &base_hash);
+        normalized.Add(Seconds(start));
+    }
+    std::size_t staged_entities = 0, staged_size = 0;
+    {
+        map_file::MapFile staged{ work_path };
+        staged_entities = staged._entities.size();
+        staged_size = staged._text.size();
+    }
+
+    std::string renamed_text{ base._text };
+    const std::string group_name = "\"_tb_name\" \"Group 3\"";
+    std::size_t pos = renamed_text.find(group_name);
+    if (pos != std::string::npos) {
+        renamed_text.replace(pos, group_name.size(), "\"_tb_name\" \"Renamed\"");
+    }
+    std::ofstream{ renamed_path, std::ios::binary } << renamed_text;
+
+    map_file::MapFile renamed{ renamed_path };
+    auto renamed_digests = renamed.GetDigests(options);
+    std::uint64_t renamed_hash = 0;
+    map_file::WriteNormalizedMap(renamed, &renamed_digests, nullptr, work_path, &renamed_hash);
+    map_file::WriteWorkMap(base, &digests, nullptr, work_path);
+    std::uint64_t plain_hash = hash::Hash(map_file::MapFile{ work_path }._text);
+    map_file::WriteWorkMap(renamed, &renamed_digests, nullptr, work_path);
+    std::uint64_t renamed_plain_hash = hash::Hash(map_file::MapFile{ work_path }._text);
+
+    std::printf("  %zu of %zu entities, %.1f of %.1f MB\n", staged_entities, base._entities.size(),
+        staged_size / (1024.0 * 1024.0), plain_size / (1024.0 * 1024.0));
+    std::printf("  renamed group: work map %s, normalized work map %s\n", plain_hash == renamed_plain_hash ? "same" : "changed",
+        base_hash == renamed_hash ? "same" : "changed");
+    PrintTiming("  WriteWorkMap", plain, plain_size);
+    PrintTiming("  WriteNormalizedMap", normalized, staged_size);
+
+    std::error_code ec;
+    fs::remove(work_path, ec);
+    fs::remove(renamed_path, ec);
+}
+
+void PrintUsage()
+{
+    std::printf(
+        "usage: map_bench [options]\n"
+        "  --brushes N          brushes in the map (20000)\n"
+        "  --lights N           light entities (1000)\n"
+        "  --entities N         point entities (2000)\n"
+        "  --brush-entities N   brush entities (500)\n"
+        "  --layers N           TrenchBroom layers (4)\n"
+        "  --groups N           TrenchBroom groups (50)\n"
+        "  --comments F         chance of a comment before each brush and entity (1)\n"
+        "  --standard           write the standard map format instead of Valve 220\n"
+        "  --seed N             generator seed (1)\n"
+        "  --iterations N       runs per measurement (5)\n"
+        "  --write PATH         write the generated map to PATH and exit\n");
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    map_generator::GeneratorOptions options;
+    int iterations = 5;
+    std::string write_path;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        bool takes_value = true;
+        if (arg == "--standard") {
+            options.valve220 = false;
+            takes_value = false;
+        }
+        else if (arg == "--help" || arg == "-h") {
+            PrintUsage();
+            return 0;
+        }
+        else if (!value) {
+            PrintUsage();
+            return 1;
+        }
+        else if (arg == "--brushes") options.brushes = std::atoi(value);
+        else if (arg == "--lights") options.lights = std::atoi(value);
+        else if (arg == "--entities") options.point_entities = std::atoi(value);
+        else if (arg == "--brush-entities") options.brush_entities = std::atoi(value);
+        else if (arg == "--layers") options.layers = std::atoi(value);
+        else if (arg == "--groups") options.groups = std::atoi(value);
+        else if (arg == "--comments") options.comment_density = std::atof(value);
+        else if (arg == "--seed") options.seed = std::strtoull(value, nullptr, 10);
+        else if (arg == "--iterations") iterations = std::max(1, std::atoi(value));
+        else if (arg == "--write") write_path = value;
+        else {
+            PrintUsage();
+            return 1;
+        }
+        if (takes_value) {
+            i++;
+        }
+    }
+
+    std::string text = map_generator::GenerateMap(options);
+    if (!write_path.empty()) {
+        return WriteFile(write_path, text) ? 0 : 1;
+    }
+
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path();
+    const std::string base_path = (dir / "map_bench_base.map").string();
+    const std::string field_path = (dir / "map_bench_field.map").string();
+    const std::string brush_path = (dir / "map_bench_brush.map").string();
+    const std::string reformat_path = (dir / "map_bench_reformat.map").string();
+    const std::string reorder_path = (dir / "map_bench_reorder.map").string();
+    const std::string texture_path = (dir / "map_bench_texture.map").string();
+
+    options.edit = map_generator::MapEdit::LIGHT_FIELD;
+    std::string field_text = map_generator::GenerateMap(options);
+    options.edit = map_generator::MapEdit::BRUSH_POINT;
+    std::string brush_text = map_generator::GenerateMap(options);
+    options.edit = map_generator::MapEdit::REFORMAT;
+    std::string reformat_text = map_generator::GenerateMap(options);
+    options.edit = map_generator::MapEdit::REORDER;
+    std::string reorder_text = map_generator::GenerateMap(options);
+    options.edit = map_generator::MapEdit::TEXTURE;
+    std::string texture_text = map_generator::GenerateMap(options);
+
+    if (!WriteFile(base_path, text) || !WriteFile(field_path, field_text) || !WriteFile(brush_path, brush_text)
+        || !WriteFile(reformat_path, reformat_text) || !WriteFile(reorder_path, reorder_text) || !WriteFile(texture_path, texture_text)) {
+        std::fprintf(stderr, "map_bench: couldn't write the generated maps to %s\n", dir.string().c_str());
+        return 1;
+    }
+
+    std::printf("map: %.1f MB, %d brushes, %d lights, %d point entities, %d brush entities, %d layers, %d groups, %s\n",
+        text.size() / (1024.0 * 1024.0), options.brushes, options.lights, options.point_entities, options.brush_entities,
+        options.layers, options.groups, options.valve220 ? "valve220" : "standard");
+
+    BenchParse(base_path, text.size(), iterations);
+    BenchContent(base_path, iterations);
+
+    std::printf("diff\n");
+    BenchDiff("single field edit", base_path, field_path, iterations);
+    BenchDiff("brush edit", base_path, brush_path, iterations);
+    BenchDiff("reformatted brush", base_path, reformat_path, iterations);
+    BenchDiff("reordered brushes", base_path, reorder_path, iterations);
+    BenchDiff("texture edit", base_path, texture_path, iterations);
+
+    BenchStaging(base_path, brush_path, iterations);
+    BenchVariants(base_path, iterations);
+    BenchRegion(base_path, iterations);
+    BenchNormalize(base_path, iterations);
+
+    BenchBsp(base_path, { { "single field edit", field_path }, { "brush edit", brush_path },
+        { "reformatted brush", reformat_path }, { "reordered brushes", reorder_path }, { "texture edit", texture_path } }, iterations);
+
+    std::error_code ec;
+    fs::remove(base_path, ec);
+    fs::remove(field_path, ec);
+    fs::remove(brush_path, ec);
+    fs::remove(reformat_path, ec);
+    fs::remove(reorder_path, ec);
+    fs::remove(texture_path, ec);
+    return 0;
+}
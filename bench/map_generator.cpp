@@ -0,0 +1,336 @@
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "map_generator.h"
+
+namespace map_generator {
+
+static const char* const TEXTURES[] = {
+    "city4_6", "metal2_3", "wall1", "wbrick1_5", "*water0", "sky1", "trigger", "clip", "rock3_2", "wood1_1",
+};
+
+static const char* const POINT_CLASSNAMES[] = {
+    "monster_army", "monster_dog", "monster_knight", "item_health", "item_shells", "weapon_nailgun",
+    "info_player_deathmatch", "info_notnull",
+};
+
+static const char* const BRUSH_CLASSNAMES[] = {
+    "func_wall", "func_door", "func_detail", "trigger_multiple", "func_illusionary",
+};
+
+/// splitmix64, so the output doesn't depend on the standard library's distributions.
+struct Random
+{
+    std::uint64_t Next()
+    {
+        std::uint64_t z = (_state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    /// Inclusive range.
+    int Range(int lo, int hi) { return lo + static_cast<int>(Next() % static_cast<std::uint64_t>(hi - lo + 1)); }
+
+    bool Chance(double p) { return static_cast<double>(Next() >> 11) * (1.0 / 9007199254740992.0) < p; }
+
+    template <typename T, std::size_t N>
+    const T& Pick(const T (&items)[N]) { return items[Next() % N]; }
+
+    std::uint64_t _state;
+};
+
+struct Generator
+{
+    void Printf(const char* fmt, ...)
+#if defined(__GNUC__)
+        __attribute__((format(printf, 2, 3)))
+#endif
+        ;
+
+    void Comment(const char* kind, int index)
+    {
+        if (_random.Chance(_options.comment_density)) {
+            Printf("// %s %d\n", kind, index);
+        }
+    }
+
+    void Brush(int index, bool edited);
+
+    void BrushList(int count, bool world);
+
+    void Layer(int index);
+
+    void Group(int index);
+
+    void BrushEntity();
+
+    void Light(bool edited);
+
+    void PointEntity();
+
+    void MaybeLayerAndGroup();
+
+    GeneratorOptions _options;
+    Random _random;
+    std::string _text;
+    int _entity_index = 0;
+};
+
+void Generator::Printf(const char* fmt, ...)
+{
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    int len = std::vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len > 0) {
+        _text.append(buf, static_cast<std::size_t>(len) < sizeof(buf) ? len : sizeof(buf) - 1);
+    }
+}
+
+void Generator::Brush(int index, bool edited)
+{
+    Comment("brush", index);
+
+    int x0 = _random.Range(-256, 255) * 16;
+    int y0 = _random.Range(-256, 255) * 16;
+    int z0 = _random.Range(-64, 63) * 16;
+    int x1 = x0 + _random.Range(1, 32) * 16;
+    int y1 = y0 + _random.Range(1, 32) * 16;
+    int z1 = z0 + _random.Range(1, 16) * 16;
+    bool reformat = edited && _options.edit == MapEdit::REFORMAT;
+    if (edited && _options.edit == MapEdit::BRUSH_POINT) {
+        x0 -= 16;
+    }
+
+    const int points[6][9] = {
+        { x0, y0, z0, x0, y1, z0, x0, y0, z1 },
+        { x1, y0, z0, x1, y0, z1, x1, y1, z0 },
+        { x0, y0, z0, x0, y0, z1, x1, y0, z0 },
+        { x0, y1, z0, x1, y1, z0, x0, y1, z1 },
+        { x0, y0, z0, x1, y0, z0, x0, y1, z0 },
+        { x0, y0, z1, x0, y1, z1, x1, y0, z1 },
+    };
+    static const char* const AXES[6][2] = {
+        { "0 1 0", "0 0 -1" }, { "0 1 0", "0 0 -1" },
+        { "1 0 0", "0 0 -1" }, { "1 0 0", "0 0 -1" },
+        { "1 0 0", "0 -1 0" }, { "1 0 0", "0 -1 0" },
+    };
+
+    const char* texture = _random.Pick(TEXTURES);
+    bool retexture = edited && _options.edit == MapEdit::TEXTURE;
+    if (retexture && !std::strchr("*stc", texture[0])) {
+        texture = "metal5_8";
+    }
+    _text += "{\n";
+    for (int f = 0; f < 6; f++) {
+        const int* p = points[f];
+        int offset_x = _random.Range(0, 63);
+        int offset_y = _random.Range(0, 63);
+        if (retexture) {
+            offset_x += 8;
+        }
+        const char* scale = _random.Chance(0.2) ? "0.5" : "1";
+        if (reformat) {
+            scale = scale[1] ? "0.500000" : "1.000000";
+            Printf("(  %d.0 %d.0 %d.0  ) (  %d.0 %d.0 %d.0  ) (  %d.0 %d.0 %d.0  )  %s  ",
+                p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], texture);
+            if (_options.valve220) {
+                Printf("[ %s %d.000 ] [ %s %d.000 ] 0.0 %s %s\n", AXES[f][0], offset_x, AXES[f][1], offset_y, scale, scale);
+            }
+            else {
+                Printf("%d.000 %d.000 0.0 %s %s\n", offset_x, offset_y, scale, scale);
+            }
+        }
+        else if (_options.valve220) {
+            Printf("( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s [ %s %d ] [ %s %d ] 0 %s %s\n",
+                p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], texture,
+                AXES[f][0], offset_x, AXES[f][1], offset_y, scale, scale);
+        }
+        else {
+            Printf("( %d %d %d ) ( %d %d %d ) ( %d %d %d ) %s %d %d 0 %s %s\n",
+                p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], texture,
+                offset_x, offset_y, scale, scale);
+        }
+    }
+    _text += "}\n";
+}
+
+void Generator::BrushList(int count, bool world)
+{
+    bool brush_edit = _options.edit == MapEdit::BRUSH_POINT || _options.edit == MapEdit::REFORMAT || _options.edit == MapEdit::TEXTURE;
+    int edited = (world && brush_edit) ? count / 2 : -1;
+    if (!world || _options.edit != MapEdit::REORDER) {
+        for (int i = 0; i < count; i++) {
+            Brush(i, i == edited);
+        }
+        return;
+    }
+
+    // Same brushes in reverse, each one generated on its own so the random draws don't change.
+    std::vector<std::string> brushes(count);
+    for (int i = 0; i < count; i++) {
+        std::swap(_text, brushes[i]);
+        Brush(i, false);
+        std::swap(_text, brushes[i]);
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        _text += brushes[i];
+    }
+}
+
+void Generator::MaybeLayerAndGroup()
+{
+    if (_options.layers > 0 && _random.Chance(0.5)) {
+        Printf("\"_tb_layer\" \"%d\"\n", _random.Range(1, _options.layers));
+    }
+    if (_options.groups > 0 && _random.Chance(0.1)) {
+        Printf("\"_tb_group\" \"%d\"\n", _options.layers + _random.Range(1, _options.groups));
+    }
+}
+
+void Generator::Layer(int index)
+{
+    Comment("entity", _entity_index++);
+    Printf("{\n\"classname\" \"func_group\"\n\"_tb_type\" \"_tb_layer\"\n\"_tb_name\" \"Layer %d\"\n\"_tb_id\" \"%d\"\n\"_tb_layer_sort_index\" \"%d\"\n",
+        index + 1, index + 1, index);
+}
+
+void Generator::Group(int index)
+{
+    Comment("entity", _entity_index++);
+    Printf("{\n\"classname\" \"func_group\"\n\"_tb_type\" \"_tb_group\"\n\"_tb_name\" \"Group %d\"\n\"_tb_id\" \"%d\"\n",
+        index + 1, _options.layers + index + 1);
+    if (_options.layers > 0) {
+        Printf("\"_tb_layer\" \"%d\"\n", _random.Range(1, _options.layers));
+    }
+}
+
+void Generator::BrushEntity()
+{
+    Comment("entity", _entity_index++);
+    const char* classname = _random.Pick(BRUSH_CLASSNAMES);
+    Printf("{\n\"classname\" \"%s\"\n", classname);
+    if (_random.Chance(0.5)) {
+        Printf("\"targetname\" \"t%d\"\n", _random.Range(1, 500));
+    }
+    if (_random.Chance(0.3)) {
+        Printf("\"_minlight\" \"%d\"\n", _random.Range(5, 50));
+    }
+    if (_random.Chance(0.2)) {
+        _text += "\"_shadow\" \"1\"\n";
+    }
+    MaybeLayerAndGroup();
+}
+
+void Generator::Light(bool edited)
+{
+    Comment("entity", _entity_index++);
+    const char* classname = _random.Chance(0.1) ? "light_fluoro" : "light";
+    int x = _random.Range(-4096, 4096);
+    int y = _random.Range(-4096, 4096);
+    int z = _random.Range(-1024, 1024);
+    int light = _random.Range(100, 400);
+    if (edited) {
+        light++;
+    }
+    Printf("{\n\"classname\" \"%s\"\n\"origin\" \"%d %d %d\"\n\"light\" \"%d\"\n", classname, x, y, z, light);
+    if (_random.Chance(0.3)) {
+        int r = _random.Range(128, 255);
+        int g = _random.Range(128, 255);
+        int b = _random.Range(128, 255);
+        Printf("\"_color\" \"%d %d %d\"\n", r, g, b);
+    }
+    if (_random.Chance(0.1)) {
+        Printf("\"delay\" \"%d\"\n", _random.Range(1, 5));
+    }
+    MaybeLayerAndGroup();
+    _text += "}\n";
+}
+
+void Generator::PointEntity()
+{
+    Comment("entity", _entity_index++);
+    const char* classname = _random.Pick(POINT_CLASSNAMES);
+    // Drawn one per statement, argument evaluation order differs between compilers.
+    int x = _random.Range(-4096, 4096);
+    int y = _random.Range(-4096, 4096);
+    int z = _random.Range(-1024, 1024);
+    int angle = _random.Range(0, 7) * 45;
+    Printf("{\n\"classname\" \"%s\"\n\"origin\" \"%d %d %d\"\n\"angle\" \"%d\"\n", classname, x, y, z, angle);
+    if (_random.Chance(0.2)) {
+        Printf("\"spawnflags\" \"%d\"\n", 1 << _random.Range(0, 11));
+    }
+    MaybeLayerAndGroup();
+    _text += "}\n";
+}
+
+/// Spreads `total` brushes over `count` containers, the first ones get the remainder.
+static int Share(int total, int count, int index)
+{
+    return total / count + (index < total % count ? 1 : 0);
+}
+
+std::string GenerateMap(const GeneratorOptions& options)
+{
+    Generator gen;
+    gen._options = options;
+    gen._random._state = options.seed;
+    // About 400 bytes per brush and 100 per point entity.
+    gen._text.reserve(static_cast<std::size_t>(options.brushes) * 400 + static_cast<std::size_t>(options.lights + options.point_entities) * 100 + 4096);
+
+    int layer_brushes = options.layers > 0 ? options.brushes / 5 : 0;
+    int group_brushes = options.groups > 0 ? options.brushes * 3 / 20 : 0;
+    int entity_brushes = options.brush_entities > 0 ? options.brushes * 3 / 20 : 0;
+    int world_brushes = options.brushes - layer_brushes - group_brushes - entity_brushes;
+
+    gen.Printf("// Game: Quake\n// Format: %s\n", options.valve220 ? "Valve" : "Standard");
+    gen.Comment("entity", gen._entity_index++);
+    gen._text += "{\n\"classname\" \"worldspawn\"\n\"wad\" \"gfx/base.wad\"\n\"message\" \"Generated map\"\n"
+        "\"_tb_mod\" \"ad\"\n\"_tb_textures\" \"textures/base\"\n\"_sunlight\" \"200\"\n\"_sunlight_mangle\" \"45 -60 0\"\n";
+    gen.BrushList(world_brushes, true);
+    gen._text += "}\n";
+
+    for (int i = 0; i < options.layers; i++) {
+        gen.Layer(i);
+        gen.BrushList(Share(layer_brushes, options.layers, i), false);
+        gen._text += "}\n";
+    }
+
+    for (int i = 0; i < options.groups; i++) {
+        gen.Group(i);
+        gen.BrushList(Share(group_brushes, options.groups, i), false);
+        gen._text += "}\n";
+    }
+
+    // Interleave the remaining entities the way a map that grew over time would have them.
+    int brush_entities = options.brush_entities;
+    int lights = options.lights;
+    int point_entities = options.point_entities;
+    int light_index = 0;
+    int brush_entity_index = 0;
+    while (brush_entities + lights + point_entities > 0) {
+        int pick = gen._random.Range(0, brush_entities + lights + point_entities - 1);
+        if (pick < brush_entities) {
+            gen.BrushEntity();
+            gen.BrushList(Share(entity_brushes, options.brush_entities, brush_entity_index++), false);
+            gen._text += "}\n";
+            brush_entities--;
+        }
+        else if (pick < brush_entities + lights) {
+            gen.Light(options.edit == MapEdit::LIGHT_FIELD && light_index == options.lights / 2);
+            light_index++;
+            lights--;
+        }
+        else {
+            gen.PointEntity();
+            point_entities--;
+        }
+    }
+
+    return std::move(gen._text);
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace map_generator {
+
+enum class MapEdit
+{
+    NONE,
+    // Changes the brightness of one light, the smallest edit the diff has to notice.
+    LIGHT_FIELD,
+    // Moves one plane point of one worldspawn brush.
+    BRUSH_POINT,
+    // Writes the numbers of one worldspawn brush with trailing zeros and extra spaces, the same
+    // geometry written differently.
+    REFORMAT,
+    // Changes the texture alignment of one worldspawn brush, and its texture if that stays solid.
+    TEXTURE,
+    // Writes the worldspawn brushes in reverse order, like an editor that reorders them on save.
+    REORDER,
+};
+
+struct GeneratorOptions
+{
+    std::uint64_t seed = 1;
+    int brushes = 20000;
+    int lights = 1000;
+    int point_entities = 2000;
+    int brush_entities = 500;
+    int layers = 4;
+    int groups = 50;
+    // Chance of a "// brush N" or "// entity N" comment before each brush and entity, 0 to 1.
+    double comment_density = 1.0;
+    bool valve220 = true;
+    MapEdit edit = MapEdit::NONE;
+};
+
+/// Generates a TrenchBroom-style Quake map. The same options always give the same text on every
+/// platform, and an edit only changes the bytes of the edited field or brush.
+std::string GenerateMap(const GeneratorOptions& options);
+
+}
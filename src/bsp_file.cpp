@@ -0,0 +1,598 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include "bsp_file.h"
+#include "path.h"
+
+namespace bsp_file {
+
+static constexpr std::size_t NUM_LUMPS = 15;
+static constexpr std::size_t LUMP_ENTITIES = 0;
+static constexpr std::size_t LUMP_VISIBILITY = 4;
+static constexpr std::size_t LUMP_LEAFS = 10;
+
+struct BspLump
+{
+    std::int32_t offset;
+    std::int32_t size;
+};
+
+// Same in every format, only the lump records differ.
+struct BspHeader
+{
+    char ident[4];
+    BspLump lumps[NUM_LUMPS];
+};
+
+// Extension lumps some tools write after the standard ones, found at the first 4-byte boundary
+// after the end of the last standard lump.
+struct BspxHeader
+{
+    char ident[4];
+    std::int32_t num_lumps;
+};
+
+struct BspxLump
+{
+    char name[24];
+    std::int32_t offset;
+    std::int32_t size;
+};
+
+static std::size_t Align4(std::size_t offset)
+{
+    return (offset + 3) & ~std::size_t(3);
+}
+
+static bool GetFormat(const char (&ident)[4], BspFormat& format)
+{
+    static const char BSP29[4] = { 29, 0, 0, 0 };
+    if (!std::memcmp(ident, BSP29, 4)) format = BSP_FORMAT_29;
+    else if (!std::memcmp(ident, "BSP2", 4)) format = BSP_FORMAT_BSP2;
+    else if (!std::memcmp(ident, "2PSB", 4)) format = BSP_FORMAT_2PSB;
+    else return false;
+    return true;
+}
+
+static bool IsLumpInFile(const BspLump& lump, std::size_t file_size)
+{
+    // empty lumps may point anywhere, the header included
+    if (lump.size == 0) {
+        return lump.offset >= 0 && static_cast<std::size_t>(lump.offset) <= file_size;
+    }
+    return lump.offset >= static_cast<std::int32_t>(sizeof(BspHeader)) && lump.size > 0
+        && static_cast<std::size_t>(lump.offset) + static_cast<std::size_t>(lump.size) <= file_size;
+}
+
+bool ReadEntityLump(const std::string& path, std::string& entities, BspFormat* format)
+{
+    std::FILE* const fh = path::OpenFile(path, "rb");
+    if (!fh) {
+        return false;
+    }
+
+    BspHeader header;
+    BspFormat header_format;
+    bool good = std::fread(&header, sizeof(header), 1, fh) == 1
+        && GetFormat(header.ident, header_format)
+        && !std::fseek(fh, 0, SEEK_END);
+
+    const BspLump& ents = header.lumps[LUMP_ENTITIES];
+    long file_size = good ? std::ftell(fh) : -1;
+    good = good && file_size >= 0 && IsLumpInFile(ents, static_cast<std::size_t>(file_size))
+        && !std::fseek(fh, ents.offset, SEEK_SET);
+
+    std::string lump;
+    if (good) {
+        lump.resize(ents.size);
+        good = std::fread(&lump[0], 1, lump.size(), fh) == lump.size();
+    }
+    std::fclose(fh);
+    if (!good) {
+        return false;
+    }
+
+    // the lump is null-terminated
+    std::size_t end = lump.find('\0');
+    if (end != std::string::npos) {
+        lump.resize(end);
+    }
+
+    entities = std::move(lump);
+    if (format) {
+        *format = header_format;
+    }
+    return true;
+}
+
+static bool ReadFile(const std::string& path, std::string& data)
+{
+    std::FILE* const fh = path::OpenFile(path, "rb");
+    if (!fh) {
+        return false;
+    }
+
+    bool good = !std::fseek(fh, 0, SEEK_END);
+    long size = good ? std::ftell(fh) : -1;
+    good = good && size >= 0 && !std::fseek(fh, 0, SEEK_SET);
+    if (good) {
+        data.resize(size);
+        good = std::fread(&data[0], 1, data.size(), fh) == data.size();
+    }
+    std::fclose(fh);
+    return good;
+}
+
+// Finds the bytes of a lump and its padding, and the end of the standard lumps. Fails if any lump is
+// out of the file or overlaps the span, those would get lost when it's replaced.
+static bool GetLumpSpan(const BspHeader& header, std::size_t file_size, std::size_t index, std::size_t& begin, std::size_t& end, std::size_t& standard_end)
+{
+    const BspLump& span = header.lumps[index];
+    if (!IsLumpInFile(span, file_size)) {
+        return false;
+    }
+    begin = span.offset;
+    end = std::min(Align4(begin + span.size), file_size);
+    standard_end = 0;
+    for (std::size_t i = 0; i < NUM_LUMPS; i++) {
+        const BspLump& lump = header.lumps[i];
+        if (!IsLumpInFile(lump, file_size)) {
+            return false;
+        }
+        if (i != index && lump.size > 0 && static_cast<std::size_t>(lump.offset) < end && static_cast<std::size_t>(lump.offset) + lump.size > begin) {
+            return false;
+        }
+        standard_end = std::max(standard_end, static_cast<std::size_t>(lump.offset) + lump.size);
+    }
+    return true;
+}
+
+// Replaces a lump of the BSP in memory. Everything from the next lump on moves by the difference in
+// padded size, BSPX lumps included.
+static bool SpliceLump(std::string& data, std::size_t index, std::string_view contents)
+{
+    BspHeader header;
+    BspFormat format;
+    if (data.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    std::size_t old_begin, old_end, standard_end;
+    if (!GetFormat(header.ident, format) || !GetLumpSpan(header, data.size(), index, old_begin, old_end, standard_end)) {
+        return false;
+    }
+
+    std::size_t padded_size = Align4(contents.size());
+    std::int64_t delta = static_cast<std::int64_t>(old_begin + padded_size) - static_cast<std::int64_t>(old_end);
+    if (static_cast<std::int64_t>(data.size()) + delta > INT32_MAX) {
+        return false;
+    }
+
+    auto move = [old_end, delta](std::int32_t& offset) {
+        if (static_cast<std::size_t>(offset) >= old_end) {
+            offset = static_cast<std::int32_t>(offset + delta);
+        }
+    };
+    for (std::size_t i = 0; i < NUM_LUMPS; i++) {
+        if (i != index) move(header.lumps[i].offset);
+    }
+    header.lumps[index].size = static_cast<std::int32_t>(contents.size());
+
+    std::string bsp;
+    bsp.reserve(data.size() + delta);
+    bsp.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    bsp.append(data, sizeof(header), old_begin - sizeof(header));
+    bsp.append(contents);
+    bsp.resize(old_begin + padded_size, '\0');
+    bsp.append(data, old_end, std::string::npos);
+
+    std::size_t bspx_offset = Align4(standard_end);
+    BspxHeader bspx;
+    if (bspx_offset + sizeof(bspx) <= data.size()) {
+        std::memcpy(&bspx, data.data() + bspx_offset, sizeof(bspx));
+        std::size_t new_offset = bspx_offset >= old_end ? bspx_offset + delta : bspx_offset;
+        for (std::int32_t i = 0; !std::memcmp(bspx.ident, "BSPX", 4) && i < bspx.num_lumps; i++) {
+            std::size_t entry = sizeof(bspx) + i * sizeof(BspxLump);
+            if (bspx_offset + entry + sizeof(BspxLump) > data.size()) {
+                break;
+            }
+            BspxLump bspx_lump;
+            std::memcpy(&bspx_lump, data.data() + bspx_offset + entry, sizeof(bspx_lump));
+            move(bspx_lump.offset);
+            std::memcpy(&bsp[new_offset + entry], &bspx_lump, sizeof(bspx_lump));
+        }
+    }
+
+    data = std::move(bsp);
+    return true;
+}
+
+static bool WriteFile(const std::string& path, std::string_view data)
+{
+    std::FILE* const fh = path::OpenFile(path, "wb");
+    if (!fh) {
+        return false;
+    }
+    bool written = std::fwrite(data.data(), 1, data.size(), fh) == data.size();
+    return (std::fclose(fh) == 0) && written;
+}
+
+bool WriteEntityLump(const std::string& path, std::string_view entities)
+{
+    BspHeader header;
+    BspFormat format;
+    std::size_t file_size = 0;
+    {
+        std::FILE* const fh = path::OpenFile(path, "rb");
+        if (!fh) {
+            return false;
+        }
+        bool good = std::fread(&header, sizeof(header), 1, fh) == 1 && !std::fseek(fh, 0, SEEK_END);
+        long size = good ? std::ftell(fh) : -1;
+        std::fclose(fh);
+        if (!good || size < 0 || !GetFormat(header.ident, format)) {
+            return false;
+        }
+        file_size = static_cast<std::size_t>(size);
+    }
+
+    std::size_t old_begin, old_end, standard_end;
+    if (!GetLumpSpan(header, file_size, LUMP_ENTITIES, old_begin, old_end, standard_end)) {
+        return false;
+    }
+
+    // the lump is null-terminated
+    std::string lump{ entities };
+    lump.push_back('\0');
+
+    if (old_begin + Align4(lump.size()) == old_end) {
+        // Same padded size, only the lump and the header change
+        header.lumps[LUMP_ENTITIES].size = static_cast<std::int32_t>(lump.size());
+        lump.resize(Align4(lump.size()), '\0');
+
+        std::FILE* const fh = path::OpenFile(path, "r+b");
+        if (!fh) {
+            return false;
+        }
+        bool written = !std::fseek(fh, static_cast<long>(old_begin), SEEK_SET)
+            && std::fwrite(lump.data(), 1, lump.size(), fh) == lump.size()
+            && !std::fseek(fh, 0, SEEK_SET)
+            && std::fwrite(&header, sizeof(header), 1, fh) == 1;
+        return (std::fclose(fh) == 0) && written;
+    }
+
+    std::string data;
+    if (!ReadFile(path, data) || data.size() != file_size || !SpliceLump(data, LUMP_ENTITIES, lump)) {
+        return false;
+    }
+    return WriteFile(path, data);
+}
+
+// Size of a leaf record. Every format starts with the contents and visofs, follows with the bounds and
+// ends with the ambient sound levels.
+static std::size_t GetLeafSize(BspFormat format, std::size_t& bounds_size)
+{
+    switch (format) {
+    case BSP_FORMAT_BSP2:
+        bounds_size = 6 * sizeof(float);
+        return 44;
+    case BSP_FORMAT_2PSB:
+        bounds_size = 6 * sizeof(std::int16_t);
+        return 32;
+    default:
+        bounds_size = 6 * sizeof(std::int16_t);
+        return 28;
+    }
+}
+
+static std::string_view GetLump(const std::string& data, const BspHeader& header, std::size_t index)
+{
+    const BspLump& lump = header.lumps[index];
+    return std::string_view(data).substr(lump.offset, lump.size);
+}
+
+bool TransplantVis(const std::string& from_path, const std::string& to_path, std::string& error)
+{
+    std::string from, to;
+    if (!ReadFile(from_path, from) || !ReadFile(to_path, to)) {
+        error = "could not read the BSP files";
+        return false;
+    }
+
+    BspHeader from_header, to_header;
+    BspFormat from_format, to_format;
+    std::size_t begin, end, standard_end;
+    bool good = from.size() >= sizeof(BspHeader) && to.size() >= sizeof(BspHeader);
+    if (good) {
+        std::memcpy(&from_header, from.data(), sizeof(BspHeader));
+        std::memcpy(&to_header, to.data(), sizeof(BspHeader));
+    }
+    good = good && GetFormat(from_header.ident, from_format) && GetFormat(to_header.ident, to_format)
+        && GetLumpSpan(from_header, from.size(), LUMP_VISIBILITY, begin, end, standard_end)
+        && GetLumpSpan(from_header, from.size(), LUMP_LEAFS, begin, end, standard_end)
+        && GetLumpSpan(to_header, to.size(), LUMP_LEAFS, begin, end, standard_end);
+    if (!good) {
+        error = "not a valid BSP file";
+        return false;
+    }
+    if (from_format != to_format) {
+        error = "the BSP format changed";
+        return false;
+    }
+
+    std::string_view visdata = GetLump(from, from_header, LUMP_VISIBILITY);
+    if (visdata.empty()) {
+        error = "the previous BSP has no visdata";
+        return false;
+    }
+
+    std::size_t bounds_size = 0;
+    const std::size_t leaf_size = GetLeafSize(to_format, bounds_size);
+    std::string_view from_leafs = GetLump(from, from_header, LUMP_LEAFS);
+    std::size_t to_leafs = to_header.lumps[LUMP_LEAFS].offset;
+    std::size_t num_leafs = from_leafs.size() / leaf_size;
+    if (from_leafs.size() != static_cast<std::size_t>(to_header.lumps[LUMP_LEAFS].size) || from_leafs.size() % leaf_size) {
+        error = std::to_string(to_header.lumps[LUMP_LEAFS].size / leaf_size) + " leafs instead of " + std::to_string(num_leafs);
+        return false;
+    }
+
+    // The visdata is indexed by leaf, the leafs have to be the same ones in the same order
+    const std::size_t visofs = 4, bounds = 8, ambient = leaf_size - 4;
+    for (std::size_t i = 0; i < num_leafs; i++) {
+        const char* from_leaf = from_leafs.data() + i * leaf_size;
+        char* to_leaf = &to[to_leafs + i * leaf_size];
+        if (std::memcmp(from_leaf, to_leaf, visofs) || std::memcmp(from_leaf + bounds, to_leaf + bounds, bounds_size)) {
+            error = "leaf " + std::to_string(i) + " changed";
+            return false;
+        }
+        std::memcpy(to_leaf + visofs, from_leaf + visofs, 4);
+        std::memcpy(to_leaf + ambient, from_leaf + ambient, 4);
+    }
+
+    if (!SpliceLump(to, LUMP_VISIBILITY, visdata)) {
+        error = "could not replace the visdata lump";
+        return false;
+    }
+    if (!WriteFile(to_path, to)) {
+        error = "could not write " + to_path;
+        return false;
+    }
+    return true;
+}
+
+bool ReadPortalHeader(const std::string& path, std::string& header)
+{
+    std::FILE* const fh = path::OpenFile(path, "rb");
+    if (!fh) {
+        return false;
+    }
+    char buf[256];
+    std::size_t size = std::fread(buf, 1, sizeof(buf), fh);
+    std::fclose(fh);
+
+    // PRT1 is followed by the leaf and portal counts, PRT2 and PRT1-AM by the cluster count as well
+    std::string_view text(buf, size);
+    std::string result;
+    for (std::size_t lines = 0; lines < 4; lines++) {
+        std::size_t eol = text.find('\n');
+        if (eol == std::string_view::npos) {
+            break;
+        }
+        std::string_view line = text.substr(0, eol);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        bool is_count = !line.empty() && std::all_of(line.begin(), line.end(), [](char c) { return c >= '0' && c <= '9'; });
+        if (lines == 0 ? line.substr(0, 3) != "PRT" : !is_count) {
+            break;
+        }
+        result.append(line).push_back('\n');
+        text.remove_prefix(eol + 1);
+    }
+    if (result.find('\n') == result.rfind('\n')) {
+        return false;
+    }
+
+    header = std::move(result);
+    return true;
+}
+
+static bool EqualsNoCase(std::string_view a, std::string_view b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+// Entities qbsp merges into the world, they aren't written to the lump.
+static bool IsWorldBrushEntity(std::string_view classname)
+{
+    for (const char* name : { "func_group", "func_detail", "func_detail_illusionary", "func_detail_wall", "func_detail_fence" }) {
+        if (EqualsNoCase(classname, name)) return true;
+    }
+    return false;
+}
+
+static void AppendField(std::string& lump, std::string_view key, std::string_view value)
+{
+    lump.append("\"").append(key).append("\" \"").append(value).append("\"\n");
+}
+
+bool MakeEntityLump(const map_file::MapFile& map, const map_file::MapDigests* digests, std::string& lump,
+    const map_file::MapLayerFilter* filter, bool normalized)
+{
+    std::string result;
+    result.reserve(map._text.size() / 16);
+
+    std::vector<const map_file::MapField*> fields;
+    std::size_t models = 1;
+    for (std::size_t i = 0; i < map._entities.size(); i++) {
+        const auto& ent = map._entities[i];
+        std::string_view classname = map.GetField(ent, map_file::ATOM_CLASSNAME);
+
+        // qbsp moves the origin of rotate_* entities and pulls in the brushes of misc_external_map
+        if (classname.substr(0, 7) == "rotate_" || classname == "misc_external_map") {
+            return false;
+        }
+        if (IsWorldBrushEntity(classname) || (filter && !filter->entities[i])) {
+            continue;
+        }
+
+        // The fields are sorted by key, their views into the map text give back the file order.
+        fields.clear();
+        for (const auto& field : map.Fields(ent)) {
+            fields.push_back(&field);
+        }
+        std::sort(fields.begin(), fields.end(), [](const map_file::MapField* a, const map_file::MapField* b) {
+            return a->key.data() < b->key.data();
+        });
+
+        std::string model;
+        if (i > 0 && !ent.brush_content.empty()) {
+            model = "*" + std::to_string(models++);
+        }
+
+        result.append("{\n");
+        if (i == 0 && digests) {
+            AppendField(result, map_file::MAP_DIGEST_FIELD, map_file::FormatDigests(*digests));
+        }
+        for (const auto* field : fields) {
+            if ((i == 0 && digests && field->key == map_file::MAP_DIGEST_FIELD) || (normalized && map_file::IsEditorKey(field->key))) {
+                continue;
+            }
+            if (!model.empty() && field->key == "model") {
+                AppendField(result, field->key, model);
+                model.clear();
+                continue;
+            }
+            AppendField(result, field->key, field->value);
+        }
+        if (!model.empty()) {
+            AppendField(result, "model", model);
+        }
+        result.append("}\n");
+    }
+
+    lump = std::move(result);
+    return true;
+}
+
+struct EntityCollector : map_file::MapVisitor
+{
+    typedef std::vector<std::pair<std::string_view, std::string_view>> Fields;
+
+    void EntityBegin() override { _entities.emplace_back(); }
+
+    void Field(std::string_view key, std::string_view value) override { _entities.back().emplace_back(key, value); }
+
+    void EntityEnd() override { std::sort(_entities.back().begin(), _entities.back().end()); }
+
+    std::vector<Fields> _entities;
+};
+
+static std::string_view FindValue(const EntityCollector::Fields& fields, std::string_view key)
+{
+    for (const auto& field : fields) {
+        if (field.first == key) return field.second;
+    }
+    return {};
+}
+
+bool CompareEntityLumps(std::string_view a, std::string_view b, std::string& difference)
+{
+    EntityCollector ents_a, ents_b;
+    map_file::VisitMapText(a, ents_a);
+    map_file::VisitMapText(b, ents_b);
+
+    if (ents_a._entities.size() != ents_b._entities.size()) {
+        difference = std::to_string(ents_a._entities.size()) + " entities instead of " + std::to_string(ents_b._entities.size());
+        return false;
+    }
+
+    for (std::size_t i = 0; i < ents_a._entities.size(); i++) {
+        const auto& fields_a = ents_a._entities[i];
+        const auto& fields_b = ents_b._entities[i];
+        if (fields_a == fields_b) {
+            continue;
+        }
+
+        difference = "entity " + std::to_string(i) + " (" + std::string{ FindValue(fields_b, "classname") } + ")";
+        auto it_a = fields_a.begin();
+        auto it_b = fields_b.begin();
+        while (it_a != fields_a.end() && it_b != fields_b.end() && *it_a == *it_b) {
+            ++it_a;
+            ++it_b;
+        }
+        if (it_b == fields_b.end() || (it_a != fields_a.end() && it_a->first < it_b->first)) {
+            difference.append(": extra field \"" + std::string{ it_a->first } + "\"");
+        }
+        else if (it_a == fields_a.end() || it_b->first < it_a->first) {
+            difference.append(": missing field \"" + std::string{ it_b->first } + "\"");
+        }
+        else {
+            difference.append(": \"" + std::string{ it_a->first } + "\" is \"" + std::string{ it_a->second }
+                + "\" instead of \"" + std::string{ it_b->second } + "\"");
+        }
+        return false;
+    }
+    return true;
+}
+
+struct WorldspawnVisitor : map_file::MapVisitor
+{
+    void EntityBegin() override { _entities++; }
+
+    void Field(std::string_view key, std::string_view value) override
+    {
+        if (_entities != 1) return;
+
+        if (key == "classname") _classname = value;
+        else if (key == map_file::MAP_DIGEST_FIELD) _digests = value;
+    }
+
+    std::size_t _entities = 0;
+    std::string _classname;
+    std::string _digests;
+};
+
+bool ReadMapDigests(const std::string& path, map_file::MapDigests& digests)
+{
+    std::string lump;
+    if (!ReadEntityLump(path, lump)) {
+        return false;
+    }
+
+    // qbsp always writes the worldspawn first
+    WorldspawnVisitor visitor;
+    map_file::VisitMapText(lump, visitor);
+    return visitor._classname == "worldspawn" && map_file::ParseDigests(visitor._digests, digests);
+}
+
+bool WriteMapDigests(const std::string& path, const map_file::MapDigests& digests)
+{
+    std::string lump;
+    if (!ReadEntityLump(path, lump)) {
+        return false;
+    }
+
+    // qbsp writes the worldspawn first, one field per line and without brushes
+    std::size_t begin = lump.find('{');
+    std::size_t end = lump.find('}', begin);
+    if (begin == std::string::npos || end == std::string::npos) {
+        return false;
+    }
+    std::string key = "\"" + std::string{ map_file::MAP_DIGEST_FIELD } + "\"";
+    std::size_t offs = lump.find(key, begin);
+    if (offs < end) {
+        std::size_t line_end = lump.find('\n', offs);
+        lump.erase(offs, (line_end < end) ? line_end + 1 - offs : end - offs);
+    }
+    lump.insert(begin + 1, "\n" + key + " \"" + map_file::FormatDigests(digests) + "\"");
+    return WriteEntityLump(path, lump);
+}
+
+}
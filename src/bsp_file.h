@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include "map_file.h"
+
+namespace bsp_file {
+
+/// Quake BSP versions with the same header layout, they only differ in the size of the lump records.
+enum BspFormat
+{
+    BSP_FORMAT_29,
+    BSP_FORMAT_BSP2,
+    // BSP2 as written by RMQ before the final format.
+    BSP_FORMAT_2PSB,
+};
+
+/// Reads the entity lump of a BSP without loading the rest of the file. Returns false if the file
+/// isn't a BSP29, BSP2 or 2PSB file or the lump is out of its bounds.
+bool ReadEntityLump(const std::string& path, std::string& entities, BspFormat* format = nullptr);
+
+/// Replaces the entity lump of a BSP and keeps every other lump byte for byte. The lumps after it,
+/// BSPX ones included, move when its padded size changes.
+bool WriteEntityLump(const std::string& path, std::string_view entities);
+
+/// Copies the visdata of a BSP into a newer build of the same map, in place of running vis again.
+/// Only works if qbsp made the same leafs, with the same contents and bounds in the same order.
+/// Returns false and leaves the BSP unchanged if it can't, with the reason in error.
+bool TransplantVis(const std::string& from_path, const std::string& to_path, std::string& error);
+
+/// Reads the format and count lines at the start of a .prt file, to tell whether qbsp made the same
+/// portals. Returns false if the file can't be read or doesn't start with them.
+bool ReadPortalHeader(const std::string& path, std::string& header);
+
+/// Entity lump as qbsp -onlyents writes it for the map, with the digests in the worldspawn if given and
+/// only the entities the filter keeps if given. Without editor keys, the map was staged normalized.
+/// Returns false if the map has entities qbsp changes in ways this doesn't, like rotate_* entities.
+bool MakeEntityLump(const map_file::MapFile& map, const map_file::MapDigests* digests, std::string& lump,
+    const map_file::MapLayerFilter* filter = nullptr, bool normalized = false);
+
+/// Compares the entities of two lumps in order, ignoring the order of their fields. Returns false
+/// and describes the first difference if they don't match.
+bool CompareEntityLumps(std::string_view a, std::string_view b, std::string& difference);
+
+/// Reads the digests of the map the BSP was built from, see map_file::MAP_DIGEST_FIELD.
+/// Returns false if the BSP can't be read or its worldspawn doesn't have them.
+bool ReadMapDigests(const std::string& path, map_file::MapDigests& digests);
+
+/// Writes the digests into the worldspawn of the BSP's entity lump, replacing any it has. Only done once
+/// every step succeeded, so a BSP that light or vis failed on isn't taken as current on the next cold start.
+bool WriteMapDigests(const std::string& path, const map_file::MapDigests& digests);
+
+}
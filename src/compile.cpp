@@ -1,8 +1,10 @@
+#include "bsp_file.h"
 #include "common.h"
 #include "compile.h"
 #include "config.h"
 #include "console.h"
 #include "map_file.h"
+#include "map_snapshot.h"
 #include "path.h"
 #include "q1compile.h"
 #include "shell_command.h"
@@ -18,15 +20,37 @@ Async jobs
 =================
 */
 
-static void ExecuteCompileCommand(const std::string& cmd, const std::string& pwd, bool suppress_output = false);
+/// Both return false if the command couldn't be started, was stopped or exited with an error.
+static bool ExecuteCompileCommand(const std::string& cmd, const std::string& pwd, bool suppress_output = false);
 
-static void ExecuteCompileProcess(const std::string& cmd, const std::string& pwd, bool suppress_output = false);
+/// Leaves the console's print to file setting alone, the caller turns it off around the processes it runs.
+static bool ExecuteCompileProcess(const std::string& cmd, const std::string& pwd, mutex_char_buffer::MutexCharBuffer* output);
+
+static bool ExecuteCompileProcess(const std::string& cmd, const std::string& pwd, bool suppress_output = false)
+{
+    console::SetPrintToFile(false);
+    bool result = ExecuteCompileProcess(cmd, pwd, suppress_output ? nullptr : &g_app->compile_output);
+    console::SetPrintToFile(true);
+    return result;
+}
 
 static void HandleFileBrowserCallback();
 
 static void ReportCopy(const std::string& from_path, const std::string& to_path);
 
-static config::ToolPreset GetMapDiffArgs(const map_file::MapFile& map_a, const map_file::MapFile& map_b, const config::Config& cfg);
+static const config::LayerSelection* FindSelectedLayers(const config::Config& cfg);
+
+static bool GetRegionBounds(const config::Config& cfg, const map_file::MapFile& map, map_file::MapBounds& bounds);
+
+static bool GetMapDiffFlags(OpenConfigState* state, const map_file::MapFile& map, const map_file::MapLayerFilter* filter,
+    const std::string& out_bsp, map_file::MapDiffFlags& flags);
+
+static config::ToolPreset GetMapDiffArgs(map_file::MapDiffFlags flags);
+
+static bool IsWorkMapCompiled(const OpenConfigState* state, const std::string& out_bsp, std::uint64_t work_map_hash);
+
+static void SaveMapBaseline(OpenConfigState* state, const std::shared_ptr<map_file::MapFile>& map, const map_file::MapLayerFilter* filter,
+    const std::string& out_bsp, std::uint64_t work_map_hash);
 
 static std::string ReplaceCompileVars(const std::string& args, const config::Config& cfg);
 
@@ -35,7 +59,8 @@ struct CompileJob
     OpenConfigState* state;
     CompileFlags flags;
 
-    bool RunTool(const std::string& exe, const std::string& args)
+    /// Returns false if the tool is missing, succeeded tells whether it ran and exited without an error.
+    bool RunTool(const std::string& exe, const std::string& args, bool& succeeded)
     {
         std::string cmd = path::Join(path::FromNative(state->config.config_paths[config::PATH_TOOLS_DIR]), exe);
         if (!path::Exists(cmd)) {
@@ -48,10 +73,91 @@ struct CompileJob
 
         cmd.append(" ");
         cmd.append(args);
-        ExecuteCompileProcess(cmd, "");
+        succeeded = ExecuteCompileProcess(cmd, "");
+        return true;
+    }
+
+    /// Writes the entity lump of the map into the work BSP in place of running qbsp -onlyents. In verify
+    /// mode qbsp runs on copies of the map and BSP as well, and its lump wins if they differ.
+    /// Returns false if qbsp has to run instead.
+    bool PatchEntityLump(const map_file::MapFile& map, const map_file::MapLayerFilter* filter, bool normalized,
+        const config::CompileStep& step, const std::string& work_map, const std::string& work_bsp)
+    {
+        std::string lump;
+        if (!bsp_file::MakeEntityLump(map, nullptr, lump, filter, normalized)) {
+            g_app->compile_output.append("The map has entities only qbsp can write, running qbsp -onlyents.\n");
+            return false;
+        }
+
+        std::string verify_map = path::Join(path::Directory(work_map), "q1compile_verify.map");
+        std::string verify_bsp = path::Join(path::Directory(work_map), "q1compile_verify.bsp");
+        bool verify = state->config.verify_entity_lump;
+        if (verify && !(path::Copy(work_map, verify_map) && path::Copy(work_bsp, verify_bsp))) {
+            g_app->compile_output.append("Could not copy the map and BSP to verify the entity lump, running qbsp -onlyents.\n");
+            return false;
+        }
+
+        auto time_begin = std::chrono::steady_clock::now();
+        if (!bsp_file::WriteEntityLump(work_bsp, lump)) {
+            g_app->compile_output.append("Could not patch the entity lump of " + work_bsp + ", running qbsp -onlyents.\n");
+            return false;
+        }
+        auto time_elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - time_begin);
+        g_app->compile_output.append("Patched the entity lump of " + work_bsp + " in " + std::to_string(time_elapsed.count() / 1000.0f) + " ms\n");
+
+        if (verify) {
+            std::string args = ReplaceCompileVars(step.args, state->config) + " " + verify_map;
+            g_app->compile_output.append("Verifying with: " + step.cmd + " " + args + "\n");
+
+            bool succeeded = false;
+            std::string qbsp_lump, difference;
+            if (!RunTool(step.cmd, args, succeeded) || !succeeded || !bsp_file::ReadEntityLump(verify_bsp, qbsp_lump)) {
+                g_app->compile_output.append("Could not verify the entity lump.\n");
+            }
+            else if (bsp_file::CompareEntityLumps(lump, qbsp_lump, difference)) {
+                g_app->compile_output.append("The entity lump matches qbsp -onlyents.\n");
+            }
+            else {
+                g_app->compile_output.append("The entity lump differs from qbsp -onlyents, using the one from qbsp: " + difference + "\n");
+                if (!bsp_file::WriteEntityLump(work_bsp, qbsp_lump)) {
+                    g_app->compile_output.append("Could not write the entity lump from qbsp.\n");
+                }
+            }
+            path::Remove(verify_map);
+            path::Remove(verify_bsp);
+        }
+        return true;
+    }
+
+    /// Copies the visdata of the output BSP into the one qbsp just built, in place of running vis.
+    /// Returns false if qbsp made other portals or leafs, vis has to run then.
+    bool TransplantVis(const std::string& out_bsp, const std::string& work_bsp, const std::string& work_prt, const std::string& old_portals)
+    {
+        std::string new_portals, error;
+        if (!bsp_file::ReadPortalHeader(work_prt, new_portals) || new_portals != old_portals) {
+            g_app->compile_output.append("Only textures changed, but the portals did too, running vis.\n");
+            return false;
+        }
+        if (!bsp_file::TransplantVis(out_bsp, work_bsp, error)) {
+            g_app->compile_output.append("Only textures changed, but the visdata can't be reused (" + error + "), running vis.\n");
+            return false;
+        }
+        g_app->compile_output.append("Only textures changed, reused the visdata of " + out_bsp + " and skipped vis.\n");
+        g_app->compile_output.append("------------------------------------------------\n");
         return true;
     }
 
+    /// Waits for the background parse, returns null if the map changed since it started.
+    std::shared_ptr<map_file::MapFile> TakePreParsedMap(const PreParsedMap& pre_parsed)
+    {
+        auto map = pre_parsed.map.get();
+        if (path::GetFileModifiedTime(pre_parsed.map_path) != pre_parsed.modified_time || path::GetFileSize(pre_parsed.map_path) != pre_parsed.size) {
+            return nullptr;
+        }
+        g_app->compile_output.append("Using the map parsed in the background.\n");
+        return map;
+    }
+
     void operator()()
     {
         bool run_quake = flags & CF_RUN_QUAKE;
@@ -78,7 +184,16 @@ struct CompileJob
         if (!no_compile) {
             g_app->compile_status = "Preparing to compile...";
 
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            // Give the editor a second to finish writing the map, counted from when the watcher saw
+            // the change if the map has been parsing in the background since.
+            auto pre_parsed = std::atomic_exchange(&state->pre_parsed_map, std::shared_ptr<PreParsedMap>{});
+            if (pre_parsed && pre_parsed->map_path == source_map) {
+                std::this_thread::sleep_until(pre_parsed->detected_time + std::chrono::seconds(1));
+            }
+            else {
+                pre_parsed = nullptr;
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
 
             auto time_begin = std::chrono::system_clock::now();
 
@@ -98,8 +213,12 @@ struct CompileJob
                 return;
             }
 
-            auto prev_map_file = std::unique_ptr<map_file::MapFile>(state->map_file.release());
-            state->map_file = std::make_unique<map_file::MapFile>(source_map);
+            // Kept until the end of the compile, the UI may load another map file in the meantime.
+            auto map = pre_parsed ? TakePreParsedMap(*pre_parsed) : nullptr;
+            if (!map) {
+                map = std::make_shared<map_file::MapFile>(source_map);
+            }
+            state->map_file = map;
             state->map_has_leak = false;
 
             g_app->compiling = true;
@@ -156,14 +275,89 @@ struct CompileJob
 
             std::vector<config::CompileStep> steps_to_compile = state->config.steps;
 
-            if (!state->map_file->Good()) {
+            // Only point entities changed, the entity lump is all qbsp -onlyents would rewrite
+            bool patch_entities = false;
+            // Only textures changed, the visdata of the output BSP still fits if qbsp makes the same leafs
+            bool transplant_vis = false;
+
+            // Only the layers of the selection are staged and diffed, edits in the other layers don't
+            // change anything the tools see. Another selection makes for a full compile.
+            std::unique_ptr<map_file::MapLayerFilter> layer_filter;
+            const config::LayerSelection* layer_selection = FindSelectedLayers(state->config);
+            if (layer_selection && map->Good()) {
+                layer_filter = std::make_unique<map_file::MapLayerFilter>(
+                    map_file::FilterMapLayers(*map, layer_selection->layers, layer_selection->default_layer_selected));
+                std::size_t kept = std::count(layer_filter->entities.begin(), layer_filter->entities.end(), true);
+                g_app->compile_output.append("Compiling the layer selection \"" + layer_selection->name + "\": "
+                    + std::to_string(kept) + " of " + std::to_string(map->_entities.size()) + " entities"
+                    + (layer_filter->world_brushes ? "" : ", without the default layer") + "\n");
+            }
+
+            // A region compile stages what's in the box, of the selected layers. It isn't diffed and
+            // doesn't become the baseline, so the next compile of the whole map is a full one.
+            std::unique_ptr<map_file::MapRegion> region;
+            if (state->config.region_enabled && map->Good()) {
+                map_file::MapBounds bounds;
+                if (!GetRegionBounds(state->config, *map, bounds)) {
+                    return;
+                }
+                region = std::make_unique<map_file::MapRegion>(map_file::FilterMapRegion(*map, bounds, layer_filter.get()));
+                std::size_t kept = std::count(region->entities.begin(), region->entities.end(), true);
+                std::size_t brushes = std::count(region->brushes.begin(), region->brushes.end(), true);
+                char box[128];
+                std::snprintf(box, sizeof(box), "(%g %g %g) to (%g %g %g)", bounds.mins[0], bounds.mins[1], bounds.mins[2],
+                    bounds.maxs[0], bounds.maxs[1], bounds.maxs[2]);
+                g_app->compile_output.append("Compiling the region " + std::string{ box } + ": " + std::to_string(kept) + " of "
+                    + std::to_string(map->_entities.size()) + " entities, " + std::to_string(brushes) + " of "
+                    + std::to_string(region->brushes.size()) + " brushes\n");
+            }
+
+            // Without the editor's metadata, saves that only change editor state write the same work map.
+            // It's written before the diff then, if the last compile's was the same nothing changed.
+            std::uint64_t work_map_hash = 0;
+            bool normalized = state->config.normalize_work_map && map->Good() && !region;
+            if (normalized) {
+                if (!map_file::WriteNormalizedMap(*map, nullptr, layer_filter.get(), work_map, &work_map_hash)) {
+                    g_app->compile_output.append("Could not write " + work_map + "\n");
+                    return;
+                }
+                if (state->config.watch_map_file && state->config.auto_apply_onlyents && !ignore_diff && !run_quake
+                    && IsWorkMapCompiled(state, out_bsp, work_map_hash)) {
+                    g_app->compile_status = "Finished, the work map is the same as for the last compile.";
+                    g_app->compile_output.append(g_app->compile_status + "\n\n");
+                    return;
+                }
+            }
+
+            if (!map->Good()) {
                 g_app->compile_output.append("Could not read map file!\n");
             }
-            else {
-                if (prev_map_file && state->config.watch_map_file && state->config.auto_apply_onlyents && !ignore_diff) {
-                    g_app->compile_output.append("Doing map diff...\n");
+            else if (!region) {
+                map_file::MapDiffFlags diff_flags;
+                if (state->config.watch_map_file && state->config.auto_apply_onlyents && !ignore_diff
+                    && GetMapDiffFlags(state, *map, layer_filter.get(), out_bsp, diff_flags)) {
+                    if (diff_flags == map_file::MAP_DIFF_NONE && !run_quake) {
+                        // Nothing the tools would see changed, the output BSP is still current
+                        g_app->compile_status = "Finished, nothing changed since the last compile.";
+                        g_app->compile_output.append(g_app->compile_status + "\n\n");
+                        return;
+                    }
 
-                    config::ToolPreset diff_pre = GetMapDiffArgs(*prev_map_file, *state->map_file, state->config);
+                    // qbsp -onlyents, the entity patch and light work on the work BSP. A stopped compile can leave
+                    // a newer one there than the output BSP the map was diffed against, start from the latter.
+                    if (!(diff_flags & (map_file::MAP_DIFF_BRUSHES | map_file::MAP_DIFF_TEXTURES))) {
+                        if (!path::Copy(out_bsp, work_bsp)) {
+                            g_app->compile_output.append("Could not copy " + out_bsp + " to " + work_bsp + "\n");
+                            return;
+                        }
+                        if (path::Exists(out_lit)) {
+                            path::Copy(out_lit, work_lit);
+                        }
+                    }
+
+                    config::ToolPreset diff_pre = GetMapDiffArgs(diff_flags);
+                    patch_entities = (diff_flags == map_file::MAP_DIFF_ENTS) && state->config.patch_entity_lump && path::Exists(work_bsp);
+                    transplant_vis = (diff_flags & map_file::MAP_DIFF_TEXTURES) && !(diff_flags & map_file::MAP_DIFF_BRUSHES);
 
                     std::vector<config::CompileStep> new_steps;
                     for (const auto& step : diff_pre.steps) {
@@ -199,7 +393,22 @@ struct CompileJob
                 }
             }
 
-            if (path::Copy(source_map, work_map)) {
+            // Copy the map as it was parsed and diffed. The digests for the next cold start go into the
+            // output BSP once every step succeeded, see SaveMapBaseline.
+            bool copied = false;
+            if (normalized) {
+                copied = true;
+            }
+            else if (region) {
+                copied = map_file::WriteRegionMap(*map, *region, work_map);
+            }
+            else if (map->Good()) {
+                copied = map_file::WriteWorkMap(*map, nullptr, layer_filter.get(), work_map);
+            }
+            else {
+                copied = path::Copy(source_map, work_map);
+            }
+            if (copied) {
                 ReportCopy(source_map, work_map);
             }
             else {
@@ -208,7 +417,19 @@ struct CompileJob
 
             if (g_app->stop_compiling) return;
 
-            // Execute compile steps
+            // Portals of the last build, to check that qbsp makes the same ones before reusing its visdata
+            std::string work_prt = work_map;
+            common::StrReplace(work_prt, ".map", ".prt");
+            std::string old_portals;
+            if (transplant_vis) {
+                auto vis_step = config::FindCompileStep(steps_to_compile, config::COMPILE_VIS);
+                transplant_vis = vis_step && vis_step->enabled && bsp_file::ReadPortalHeader(work_prt, old_portals);
+            }
+            bool vis_transplanted = false;
+
+            // Execute compile steps. A failed step doesn't stop the ones after it, but the map isn't
+            // taken as the new diff baseline then.
+            bool steps_succeeded = true;
             for (const auto& step : steps_to_compile) {
                 if (g_app->stop_compiling) return;
                 if (!step.enabled) continue;
@@ -217,7 +438,9 @@ struct CompileJob
                     auto cmd = ReplaceCompileVars(step.cmd, state->config);
                     g_app->compile_output.append("Starting: " + cmd + "\n");
                     g_app->compile_status = cmd;
-                    ExecuteCompileCommand(cmd, "");
+                    if (!ExecuteCompileCommand(cmd, "")) {
+                        steps_succeeded = false;
+                    }
                     g_app->compile_output.append("Finished: " + cmd + "\n");
                 }
                 else {
@@ -239,13 +462,31 @@ struct CompileJob
                         break;
                     }
 
+                    if (step.type == config::COMPILE_QBSP && patch_entities && PatchEntityLump(*map, layer_filter.get(), normalized, step, work_map, work_bsp)) {
+                        g_app->compile_output.append("------------------------------------------------\n");
+                        continue;
+                    }
+                    if (step.type == config::COMPILE_VIS && vis_transplanted) {
+                        continue;
+                    }
+
                     g_app->compile_output.append("Starting: " + step.cmd + " " + args + "\n");
-                    if (!RunTool(step.cmd, args)) return;
+                    bool succeeded = false;
+                    if (!RunTool(step.cmd, args, succeeded)) return;
+                    if (!succeeded) {
+                        steps_succeeded = false;
+                    }
                     g_app->compile_output.append("Finished: " + step.cmd + " " + args + "\n");
                     g_app->compile_output.append("------------------------------------------------\n");
+
+                    if (step.type == config::COMPILE_QBSP && transplant_vis && succeeded) {
+                        vis_transplanted = TransplantVis(out_bsp, work_bsp, work_prt, old_portals);
+                    }
                 }
             }
 
+            if (g_app->stop_compiling) return;
+
             if (copy_bsp && path::Exists(work_bsp)) {
                 if (path::Copy(work_bsp, out_bsp)) {
                     ReportCopy(work_bsp, out_bsp);
@@ -269,6 +510,13 @@ struct CompileJob
             g_app->compile_status = "Finished in " + std::to_string(secs) + " seconds.";
             g_app->compile_output.append(g_app->compile_status);
             g_app->compile_output.append("\n\n");
+
+            if (steps_succeeded && !region) {
+                SaveMapBaseline(state, map, layer_filter.get(), out_bsp, work_map_hash);
+            }
+            else if (!steps_succeeded) {
+                g_app->compile_output.append("Some steps failed, the next map diff is still against the last successful compile.\n\n");
+            }
         }
 
         if (run_quake) {
@@ -276,9 +524,21 @@ struct CompileJob
 
             std::string args = state->config.quake_args;
 
-            if (state->config.use_map_mod && state->map_file.get() && (args.find("-game") == std::string::npos)) {
-                args.append(" -game ");
-                args.append(state->map_file->GetTBMod());
+            if (state->config.use_map_mod && (args.find("-game") == std::string::npos)) {
+                // Nothing compiled yet this session, stream the map for its worldspawn
+                std::string mod;
+                std::vector<map_file::MapLayer> layers;
+                bool has_mod = true;
+                if (auto map = state->map_file) {
+                    mod = map->GetTBMod();
+                }
+                else {
+                    has_mod = map_file::ReadMapLayers(source_map, layers, &mod);
+                }
+                if (has_mod) {
+                    args.append(" -game ");
+                    args.append(mod);
+                }
             }
 
             if (args.find("+map") == std::string::npos) {
@@ -306,6 +566,199 @@ struct CompileJob
     }
 };
 
+/// Builds several layer selections of the map side by side, see StartLayerVariantsJob.
+struct LayerVariantsJob
+{
+    OpenConfigState* state;
+
+    struct Variant
+    {
+        config::LayerSelection selection;
+        map_file::MapLayerFilter filter;
+        std::string work_map;
+        std::string out_bsp;
+        // Tool output, kept apart while the variants build and printed one after the other.
+        mutex_char_buffer::MutexCharBuffer output;
+        // Seconds taken by the staging and each step, for the summary.
+        std::vector<std::pair<std::string, float>> timings;
+        bool succeeded = true;
+    };
+
+    /// The selection name with the characters paths and tool arguments could trip over replaced.
+    static std::string GetVariantSuffix(const std::string& name)
+    {
+        std::string suffix;
+        for (char c : name) {
+            bool keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+            suffix.push_back(keep ? c : '_');
+        }
+        return suffix;
+    }
+
+    static float SecondsSince(std::chrono::steady_clock::time_point begin)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count() / 1000.0f;
+    }
+
+    /// Stages the variant's layers into its work subdir and runs the tools on them, on its own thread.
+    void Build(const map_file::MapFile& map, Variant& variant)
+    {
+        auto time_begin = std::chrono::steady_clock::now();
+        if (!path::Create(path::Directory(variant.work_map)) || !map_file::WriteWorkMap(map, nullptr, &variant.filter, variant.work_map)) {
+            variant.output.append("Could not write " + variant.work_map + "\n");
+            variant.succeeded = false;
+            return;
+        }
+        variant.timings.emplace_back("staging", SecondsSince(time_begin));
+
+        std::string work_bsp = variant.work_map;
+        std::string work_lit = variant.work_map;
+        common::StrReplace(work_bsp, ".map", ".bsp");
+        common::StrReplace(work_lit, ".map", ".lit");
+
+        // What the last run left would be copied out if qbsp fails this time
+        path::Remove(work_bsp);
+        path::Remove(work_lit);
+
+        // A failed step doesn't stop the ones after it, same as a compile of the whole map
+        for (const auto& step : state->config.steps) {
+            if (g_app->stop_compiling) return;
+            // Custom commands work on the files of the main compile
+            if (!step.enabled || step.type == config::COMPILE_CUSTOM) continue;
+
+            std::string cmd = path::Join(path::FromNative(state->config.config_paths[config::PATH_TOOLS_DIR]), step.cmd);
+            if (!path::Exists(cmd)) {
+                variant.output.append(step.cmd + " not found, is the tools directory right?\n");
+                variant.succeeded = false;
+                return;
+            }
+
+            std::string args = ReplaceCompileVars(step.args, state->config) + " " + (step.type == config::COMPILE_QBSP ? variant.work_map : work_bsp);
+            variant.output.append("Starting: " + step.cmd + " " + args + "\n");
+            auto step_begin = std::chrono::steady_clock::now();
+            if (!ExecuteCompileProcess(cmd + " " + args, "", &variant.output)) {
+                variant.succeeded = false;
+            }
+            variant.timings.emplace_back(step.cmd, SecondsSince(step_begin));
+            variant.output.append("Finished: " + step.cmd + " " + args + "\n");
+        }
+
+        if (!path::Exists(work_bsp) || !path::Copy(work_bsp, variant.out_bsp)) {
+            variant.output.append("Could not copy " + work_bsp + " to " + variant.out_bsp + "\n");
+            variant.succeeded = false;
+            return;
+        }
+        if (path::Exists(work_lit)) {
+            std::string out_lit = variant.out_bsp;
+            common::StrReplace(out_lit, ".bsp", ".lit");
+            path::Copy(work_lit, out_lit);
+        }
+        variant.timings.emplace_back("total", SecondsSince(time_begin));
+    }
+
+    void operator()()
+    {
+        std::string source_map = path::FromNative(state->config.config_paths[config::PATH_MAP_SOURCE]);
+        std::string work_dir = path::FromNative(state->config.config_paths[config::PATH_WORK_DIR]);
+        std::string out_dir = path::FromNative(state->config.config_paths[config::PATH_OUTPUT_DIR]);
+        std::string map_name, map_ext;
+        path::SplitExtension(path::Filename(source_map), map_name, map_ext);
+
+        std::vector<config::LayerSelection> selections;
+        for (const auto& sel : state->config.layer_selections) {
+            if (sel.build_variant) {
+                selections.push_back(sel);
+            }
+        }
+        if (selections.empty()) {
+            selections = state->config.layer_selections;
+        }
+        if (selections.empty()) {
+            g_app->compile_output.append("There are no layer selections to build, add some with 'Compile -> Manage layer selections...'.\n");
+            return;
+        }
+
+        g_app->compiling = true;
+        common::ScopeGuard end{ []() {
+            g_app->compiling = false;
+            g_app->stop_compiling = false;
+            g_app->console_lock_scroll = false;
+
+            if (g_app->compile_status.find("Finished") == std::string::npos) {
+                g_app->compile_status = "Stopped.";
+            }
+        } };
+
+        auto time_begin = std::chrono::steady_clock::now();
+        g_app->compile_status = "Reading the map...";
+
+        // One parse and one fingerprinting for all the variants, they only combine the digests of
+        // the entities they keep.
+        auto map = std::make_shared<map_file::MapFile>(source_map);
+        if (!map->Good()) {
+            g_app->compile_output.append("Could not read map file!\n");
+            return;
+        }
+        auto baseline = std::atomic_load(&state->baseline_map);
+        map->GetFingerprints(state->diff_options, baseline ? baseline->GetFingerprints(state->diff_options).get() : nullptr);
+        state->map_file = map;
+        g_app->compile_output.append("Read " + source_map + " in " + std::to_string(SecondsSince(time_begin)) + " seconds.\n");
+
+        std::vector<std::unique_ptr<Variant>> variants;
+        std::vector<std::string> suffixes;
+        for (auto& sel : selections) {
+            std::string suffix = GetVariantSuffix(sel.name);
+            while (std::find(suffixes.begin(), suffixes.end(), suffix) != suffixes.end()) {
+                suffix += "_";
+            }
+            suffixes.push_back(suffix);
+
+            auto variant = std::make_unique<Variant>();
+            variant->filter = map_file::FilterMapLayers(*map, sel.layers, sel.default_layer_selected);
+            variant->selection = std::move(sel);
+            variant->work_map = path::Join(path::Join(work_dir, suffix), path::Filename(source_map));
+            variant->out_bsp = path::Join(out_dir, map_name + "_" + suffix + ".bsp");
+            variants.push_back(std::move(variant));
+        }
+
+        g_app->compile_status = "Building " + std::to_string(variants.size()) + " layer variants...";
+
+        // Once for the whole batch, the tools of every variant run at the same time
+        console::SetPrintToFile(false);
+        common::ScopeGuard print_to_file{ []() { console::SetPrintToFile(true); } };
+        std::vector<std::thread> threads;
+        for (auto& variant : variants) {
+            threads.emplace_back([this, &map, &variant]() { Build(*map, *variant); });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        for (auto& variant : variants) {
+            g_app->compile_output.append("------------------------------------------------\n");
+            g_app->compile_output.append("Layer variant \"" + variant->selection.name + "\":\n");
+            while (!variant->output.empty()) {
+                g_app->compile_output.push(variant->output.pop());
+            }
+        }
+        g_app->compile_output.append("------------------------------------------------\n");
+
+        if (g_app->stop_compiling) return;
+
+        for (const auto& variant : variants) {
+            std::string str = variant->selection.name + ": ";
+            for (const auto& timing : variant->timings) {
+                str += timing.first + " " + std::to_string(timing.second) + " s, ";
+            }
+            str += variant->succeeded ? variant->out_bsp : "failed";
+            g_app->compile_output.append(str + "\n");
+        }
+
+        g_app->compile_status = "Finished " + std::to_string(variants.size()) + " layer variants in " + std::to_string(SecondsSince(time_begin)) + " seconds.";
+        g_app->compile_output.append(g_app->compile_status + "\n\n");
+    }
+};
+
 struct HelpJob
 {
     OpenConfigState* state;
@@ -364,13 +817,13 @@ static void ReadToMutexCharBuffer(T& obj, std::atomic_bool* stop, mutex_char_buf
     }
 }
 
-static void ExecuteCompileCommand(const std::string& cmd, const std::string& pwd, bool suppress_output)
+static bool ExecuteCompileCommand(const std::string& cmd, const std::string& pwd, bool suppress_output)
 {
     shell_command::ShellCommand proc{ cmd, pwd };
     if (!proc.Good()) {
         console::PrintError(cmd.c_str());
         console::PrintError(": failed to execute command\n");
-        return;
+        return false;
     }
 
     auto output = &g_app->compile_output;
@@ -381,25 +834,44 @@ static void ExecuteCompileCommand(const std::string& cmd, const std::string& pwd
     console::SetPrintToFile(false);
     ReadToMutexCharBuffer(proc, &g_app->stop_compiling, output);
     console::SetPrintToFile(true);
+
+    if (g_app->stop_compiling) {
+        return false;
+    }
+    int status = proc.Close();
+    if (status != 0) {
+        g_app->compile_output.append(cmd + ": exited with code " + std::to_string(status) + "\n");
+        return false;
+    }
+    return true;
 }
 
-static void ExecuteCompileProcess(const std::string& cmd, const std::string& pwd, bool suppress_output)
+/// Output goes to the given buffer, errors too unless it's null.
+static bool ExecuteCompileProcess(const std::string& cmd, const std::string& pwd, mutex_char_buffer::MutexCharBuffer* output)
 {
     sub_process::SubProcess proc{ cmd, pwd };
     if (!proc.Good()) {
         console::PrintError(cmd.c_str());
         console::PrintError(": failed to open subprocess\n");
-        return;
+        return false;
     }
 
-    auto output = &g_app->compile_output;
-    if (suppress_output) {
-        output = nullptr;
-    }
-
-    console::SetPrintToFile(false);
     ReadToMutexCharBuffer(proc, &g_app->stop_compiling, output);
-    console::SetPrintToFile(true);
+
+    if (g_app->stop_compiling) {
+        return false;
+    }
+    auto errors = output ? output : &g_app->compile_output;
+    unsigned long exit_code = 0;
+    if (!proc.Wait(exit_code)) {
+        errors->append(cmd + ": could not get the exit code\n");
+        return false;
+    }
+    if (exit_code != 0) {
+        errors->append(cmd + ": exited with code " + std::to_string(exit_code) + "\n");
+        return false;
+    }
+    return true;
 }
 
 static void ReportCopy(const std::string& from_path, const std::string& to_path)
@@ -411,19 +883,272 @@ static void ReportCopy(const std::string& from_path, const std::string& to_path)
     g_app->compile_output.append("\n");
 }
 
-static config::ToolPreset GetMapDiffArgs(const map_file::MapFile& map_a, const map_file::MapFile& map_b, const config::Config& cfg)
+/// Returns null if every layer is compiled.
+static const config::LayerSelection* FindSelectedLayers(const config::Config& cfg)
+{
+    for (const auto& sel : cfg.layer_selections) {
+        if (sel.name == cfg.selected_layers) {
+            return &sel;
+        }
+    }
+    return nullptr;
+}
+
+/// The box of a region compile, see config::Config::region_box. Reports why if there's none.
+static bool GetRegionBounds(const config::Config& cfg, const map_file::MapFile& map, map_file::MapBounds& bounds)
+{
+    if (!cfg.region_entity.empty()) {
+        for (std::size_t i = 0; i < map._entities.size(); i++) {
+            for (const auto& field : map.Fields(map._entities[i])) {
+                if (field.key != "targetname" || field.value != cfg.region_entity || !map_file::GetEntityBounds(map, i, bounds)) {
+                    continue;
+                }
+                for (int axis = 0; axis < 3; axis++) {
+                    bounds.mins[axis] -= cfg.region_margin;
+                    bounds.maxs[axis] += cfg.region_margin;
+                }
+                return true;
+            }
+        }
+        g_app->compile_output.append("No entity has the targetname \"" + cfg.region_entity + "\" to compile the region around.\n");
+        return false;
+    }
+
+    double box[6];
+    if (!map_file::ParseNumbers(cfg.region_box, box, 6)) {
+        g_app->compile_output.append("The region box \"" + cfg.region_box + "\" isn't six numbers, \"x1 y1 z1 x2 y2 z2\".\n");
+        return false;
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        bounds.mins[axis] = std::min(box[axis], box[axis + 3]);
+        bounds.maxs[axis] = std::max(box[axis], box[axis + 3]);
+    }
+    return true;
+}
+
+static std::string GetMapSnapshotPath(const config::Config& cfg)
+{
+    std::string source_map = path::FromNative(cfg.config_paths[config::PATH_MAP_SOURCE]);
+    std::string work_dir = path::FromNative(cfg.config_paths[config::PATH_WORK_DIR]);
+    return path::Join(work_dir, map_snapshot::GetSnapshotFilename(source_map));
+}
+
+void BuildMapDiffOptions(OpenConfigState* state)
+{
+    const auto& cfg = state->config;
+    auto& options = state->diff_options;
+    options.custom_worldspawn_light_fields = cfg.custom_worldspawn_light_fields;
+    options.custom_brush_light_fields = cfg.custom_brush_light_fields;
+    options.custom_light_entities = cfg.custom_light_entities;
+    options.ignore_field_diff = cfg.ignore_field_diff;
+    options.brush_epsilon = cfg.brush_diff_epsilon;
+    options.Build();
+}
+
+static map_snapshot::MapSnapshot MakeMapSnapshot(const map_file::MapFile& map, const map_file::MapLayerFilter* filter, const OpenConfigState* state)
+{
+    return map_snapshot::MakeSnapshot(map, path::FromNative(state->config.config_paths[config::PATH_MAP_SOURCE]), state->diff_options, filter);
+}
+
+/// Lists the entities that changed since the previous compile, up to a few of them, so it's clear why
+/// a step is or isn't skipped.
+static void ReportMapChanges(const map_file::MapChangeSet& changes, const map_file::MapFile& map)
+{
+    static constexpr std::size_t MAX_REPORTED = 8;
+
+    g_app->compile_output.append("Changed entities: " + std::to_string(changes.added.size()) + " added, "
+        + std::to_string(changes.removed.size()) + " removed, " + std::to_string(changes.modified.size()) + " modified\n");
+
+    auto describe = [&map](std::uint32_t index) {
+        std::string str = "  entity " + std::to_string(index);
+        std::string_view classname = map.GetField(map._entities[index], map_file::ATOM_CLASSNAME);
+        if (!classname.empty()) {
+            str.append(" (").append(classname).append(")");
+        }
+        map_file::MapLocation loc;
+        if (map.FindEntityLocation(index, loc)) {
+            str.append(" at line " + std::to_string(loc.line));
+        }
+        return str;
+    };
+
+    std::size_t reported = 0;
+    for (std::uint32_t index : changes.added) {
+        if (reported++ >= MAX_REPORTED) break;
+        g_app->compile_output.append(describe(index) + ": added\n");
+    }
+    for (const auto& change : changes.modified) {
+        if (reported++ >= MAX_REPORTED) break;
+        std::string str = describe(change.new_index) + ":";
+        if (change.flags & map_file::MAP_DIFF_BRUSHES) {
+            str.append(" brushes");
+        }
+        else if (change.flags & map_file::MAP_DIFF_TEXTURES) {
+            str.append(" textures");
+        }
+        for (const auto& key : change.fields) {
+            str.append(" ").append(key);
+        }
+        g_app->compile_output.append(str + "\n");
+    }
+    if (reported > MAX_REPORTED) {
+        g_app->compile_output.append("  ...\n");
+    }
+}
+
+/// Drops the changes to entities outside the layer selection, in the old or the new version of the map.
+static void FilterMapChanges(map_file::MapChangeSet& changes, const map_file::MapFile& old_map, const map_file::MapLayerFilter& old_filter,
+    const map_file::MapLayerFilter& new_filter)
+{
+    auto excluded = [&](std::uint32_t index) { return !new_filter.entities[index]; };
+    changes.added.erase(std::remove_if(changes.added.begin(), changes.added.end(), excluded), changes.added.end());
+    changes.removed.erase(std::remove_if(changes.removed.begin(), changes.removed.end(),
+        [&](std::uint32_t index) { return !old_filter.entities[index]; }), changes.removed.end());
+
+    changes.modified.erase(std::remove_if(changes.modified.begin(), changes.modified.end(), [&](const map_file::MapEntityChange& change) {
+        if (!old_filter.entities[change.old_index] && excluded(change.new_index)) {
+            return true;
+        }
+        // Without the default layer only the fields of the worldspawn are compiled
+        bool world = old_map.GetField(old_map._entities[change.old_index], map_file::ATOM_CLASSNAME) == "worldspawn";
+        return world && !new_filter.world_brushes && change.fields.empty();
+    }), changes.modified.end());
+}
+
+static bool GetMapDiffFlags(OpenConfigState* state, const map_file::MapFile& map, const map_file::MapLayerFilter* filter,
+    const std::string& out_bsp, map_file::MapDiffFlags& flags)
+{
+    if (!path::Exists(out_bsp)) {
+        return false;
+    }
+
+    // No snapshot of this map (the work dir is new or was cleaned), the entity lump of the output BSP
+    // still has the digests of the map it was built from.
+    std::string source_map = path::FromNative(state->config.config_paths[config::PATH_MAP_SOURCE]);
+    if (!state->map_snapshot || state->map_snapshot->map_path != source_map) {
+        map_file::MapDigests bsp_digests;
+        if (!bsp_file::ReadMapDigests(out_bsp, bsp_digests)) {
+            return false;
+        }
+        g_app->compile_output.append("Doing map diff against the output BSP...\n");
+
+        flags = map_file::GetDiffFlags(bsp_digests, map.GetDigests(state->diff_options, filter));
+        return true;
+    }
+
+    // Only diff against the last successful compile, and only while the output BSP is still the one it
+    // built. Otherwise a compile failed or something else wrote the BSP since.
+    if (!map_snapshot::IsSnapshotCurrent(*state->map_snapshot, source_map, path::GetFileModifiedTime(out_bsp), path::GetFileSize(out_bsp))) {
+        return false;
+    }
+
+    // The baseline diff filters both versions with the current selection, it can't tell that the output
+    // BSP was built from another selection or with other diff options.
+    if (state->map_snapshot->options_hash != map.GetDigests(state->diff_options, filter).options_hash) {
+        g_app->compile_output.append("The last compile was of another layer selection or with other diff options, running every step.\n");
+        return false;
+    }
+
+    if (auto baseline = std::atomic_load(&state->baseline_map)) {
+        g_app->compile_output.append("Doing map diff...\n");
+
+        auto changes = map_file::GetChangeSet(*baseline, map, state->diff_options);
+        const config::LayerSelection* selection = FindSelectedLayers(state->config);
+        if (filter && selection) {
+            // The layers resolve on their own in each version, an entity can move in or out of the selection
+            auto baseline_filter = map_file::FilterMapLayers(*baseline, selection->layers, selection->default_layer_selected);
+            FilterMapChanges(changes, *baseline, baseline_filter, *filter);
+            changes.flags = map_file::GetDiffFlags(baseline->GetDigests(state->diff_options, &baseline_filter),
+                map.GetDigests(state->diff_options, filter));
+        }
+        ReportMapChanges(changes, map);
+        flags = changes.flags;
+        return true;
+    }
+
+    // No baseline in memory yet (first compile of the session), use the snapshot saved with it.
+    g_app->compile_output.append("Doing map diff against the last compile...\n");
+
+    flags = map_snapshot::GetDiffFlags(*state->map_snapshot, MakeMapSnapshot(map, filter, state));
+    return true;
+}
+
+/// Whether the output BSP was built from a normalized work map with this hash, by the last compile.
+static bool IsWorkMapCompiled(const OpenConfigState* state, const std::string& out_bsp, std::uint64_t work_map_hash)
+{
+    std::string source_map = path::FromNative(state->config.config_paths[config::PATH_MAP_SOURCE]);
+    return work_map_hash && state->map_snapshot && state->map_snapshot->work_map_hash == work_map_hash && path::Exists(out_bsp)
+        && map_snapshot::IsSnapshotCurrent(*state->map_snapshot, source_map, path::GetFileModifiedTime(out_bsp), path::GetFileSize(out_bsp));
+}
+
+static void SaveMapBaseline(OpenConfigState* state, const std::shared_ptr<map_file::MapFile>& map, const map_file::MapLayerFilter* filter,
+    const std::string& out_bsp, std::uint64_t work_map_hash)
+{
+    if (!map->Good() || !path::Exists(out_bsp)) {
+        return;
+    }
+
+    // The next cold start diffs against these, a BSP from a compile with failed steps never gets them
+    auto snap = std::make_unique<map_snapshot::MapSnapshot>(MakeMapSnapshot(*map, filter, state));
+    map_file::MapDigests digests{ snap->options_hash, snap->brush_hash, snap->entity_hash, snap->light_hash, snap->shape_hash };
+    if (!bsp_file::WriteMapDigests(out_bsp, digests)) {
+        g_app->compile_output.append("Could not write the map digests to " + out_bsp + ".\n");
+    }
+    snap->bsp_modified_time = path::GetFileModifiedTime(out_bsp);
+    snap->bsp_size = path::GetFileSize(out_bsp);
+    snap->work_map_hash = work_map_hash;
+
+    if (!map_snapshot::WriteSnapshot(GetMapSnapshotPath(state->config), *snap)) {
+        g_app->compile_output.append("Could not write the map snapshot to the work dir.\n");
+    }
+    state->map_snapshot = std::move(snap);
+    std::atomic_store(&state->baseline_map, std::shared_ptr<const map_file::MapFile>{ map });
+}
+
+void LoadMapSnapshot(OpenConfigState* state)
+{
+    // The baseline in memory was built from whatever map the config pointed at before.
+    std::atomic_store(&state->baseline_map, std::shared_ptr<const map_file::MapFile>{});
+
+    auto snap = std::make_unique<map_snapshot::MapSnapshot>();
+    if (map_snapshot::ReadSnapshot(GetMapSnapshotPath(state->config), *snap)) {
+        state->map_snapshot = std::move(snap);
+    }
+    else {
+        state->map_snapshot = nullptr;
+    }
+}
+
+void StartPreParse(OpenConfigState* state)
+{
+    auto pre_parsed = std::make_shared<PreParsedMap>();
+    pre_parsed->map_path = path::FromNative(state->config.config_paths[config::PATH_MAP_SOURCE]);
+    pre_parsed->modified_time = path::GetFileModifiedTime(pre_parsed->map_path);
+    pre_parsed->size = path::GetFileSize(pre_parsed->map_path);
+    pre_parsed->detected_time = std::chrono::steady_clock::now();
+
+    std::promise<std::shared_ptr<map_file::MapFile>> promise;
+    pre_parsed->map = promise.get_future().share();
+
+    // Fingerprinting against the baseline only hashes the brushes that were edited, and the diff of the
+    // compile job finds them cached. A detached thread, a std::async future would block whoever drops it.
+    std::thread([promise = std::move(promise), path = pre_parsed->map_path, options = state->diff_options,
+        baseline = std::atomic_load(&state->baseline_map)]() mutable {
+        auto map = std::make_shared<map_file::MapFile>(path);
+        if (map->Good()) {
+            map->GetFingerprints(options, baseline ? baseline->GetFingerprints(options).get() : nullptr);
+        }
+        promise.set_value(std::move(map));
+    }).detach();
+
+    std::atomic_store(&state->pre_parsed_map, std::move(pre_parsed));
+}
+
+static config::ToolPreset GetMapDiffArgs(map_file::MapDiffFlags flags)
 {
     config::ToolPreset pre = {};
-    
-    auto flags = map_file::GetDiffFlags(
-        map_a, map_b,
-        cfg.custom_worldspawn_light_fields,
-        cfg.custom_brush_light_fields,
-        cfg.custom_light_entities,
-        cfg.ignore_field_diff
-    );
-
-    if (flags & map_file::MAP_DIFF_BRUSHES) {
+
+    if (flags & (map_file::MAP_DIFF_BRUSHES | map_file::MAP_DIFF_TEXTURES)) {
         pre.steps.push_back(config::CompileStep{config::COMPILE_QBSP, "qbsp.exe", "", true, 0});
         pre.steps.push_back(config::CompileStep{config::COMPILE_LIGHT, "light.exe", "", true, 0});
         pre.steps.push_back(config::CompileStep{config::COMPILE_VIS, "vis.exe", "", true, 0});
@@ -518,6 +1243,20 @@ void StartCompileJob(OpenConfigState* cfg, CompileFlags flags)
     EnqueueCompileJob(cfg, flags);
 }
 
+void StartLayerVariantsJob(OpenConfigState* cfg)
+{
+    g_app->console_auto_scroll = true;
+    g_app->console_lock_scroll = true;
+    console::ClearConsole();
+
+    if (g_app->compiling) {
+        g_app->stop_compiling = true;
+    }
+
+    g_app->last_job_ran_quake = false;
+    g_app->compile_queue->AddWork(0, LayerVariantsJob{ cfg });
+}
+
 void StartHelpJob(config::CompileStepType cstype)
 {
     g_app->compile_queue->AddWork(0, HelpJob{ g_app->current_config, cstype });
@@ -1,6 +1,10 @@
 #pragma once 
 
+#include <chrono>
+#include <future>
+#include <memory>
 #include "config.h"
+#include "map_file.h"
 
 struct OpenConfigState;
 
@@ -13,6 +17,18 @@ enum CompileFlags : unsigned int {
     CF_NO_COMPILE = 1 << 2,
 };
 
+/// A map parsed and fingerprinted on a background thread as soon as the watcher saw it change, for
+/// the next compile job to pick up instead of parsing it again.
+struct PreParsedMap
+{
+    std::string map_path;
+    // The file as it was before the parse started, the map is only used while it's unchanged.
+    unsigned long long modified_time = 0;
+    std::uint64_t size = 0;
+    std::chrono::steady_clock::time_point detected_time;
+    std::shared_future<std::shared_ptr<map_file::MapFile>> map;
+};
+
 void StartHelpJob(config::CompileStepType);
 
 void StartCompileJob(OpenConfigState* cfg, CompileFlags);
@@ -21,4 +37,17 @@ void StartShellCommandJob(OpenConfigState* cfg, const std::string& cmd);
 
 void EnqueueCompileJob(OpenConfigState* cfg, CompileFlags);
 
+/// Builds the layer selections marked as variants, or all of them if none is, at the same time from
+/// one parse of the map. Each gets its own work subdir and an output BSP suffixed with its name.
+void StartLayerVariantsJob(OpenConfigState* cfg);
+
+/// Starts parsing and fingerprinting the config's map in the background, for the next compile job.
+void StartPreParse(OpenConfigState* cfg);
+
+/// Loads the snapshot of the last successful compile of the config's map from the work dir.
+void LoadMapSnapshot(OpenConfigState* cfg);
+
+/// Builds the config's map diff options from its custom field lists, once when it's loaded.
+void BuildMapDiffOptions(OpenConfigState* cfg);
+
 }
\ No newline at end of file
@@ -2,9 +2,11 @@
 #include <sstream>
 #include <functional>
 #include <cctype>
+#include <cstdlib>
 #include <string>
 #include "config.h"
 #include "common.h"
+#include "map_file.h"
 #include "path.h"
 #include "console.h"
 
@@ -235,6 +237,9 @@ static void SetLayerSelectionVar(const std::string& name, ConfigLineParser& p, s
     else if (name == "layer_selection_default") {
         p.ParseBool(selections.back().default_layer_selected);
     }
+    else if (name == "layer_selection_variant") {
+        p.ParseBool(selections.back().build_variant);
+    }
     else if (name == "layer_selection_layer") {
         std::string layername{};
         p.ParseString(layername);
@@ -282,6 +287,30 @@ static void SetConfigVar(Config& config, std::string name, ConfigLineParser& p)
     else if (name == "auto_apply_onlyents") {
         p.ParseBool(config.auto_apply_onlyents);
     }
+    else if (name == "patch_entity_lump") {
+        p.ParseBool(config.patch_entity_lump);
+    }
+    else if (name == "verify_entity_lump") {
+        p.ParseBool(config.verify_entity_lump);
+    }
+    else if (name == "normalize_work_map") {
+        p.ParseBool(config.normalize_work_map);
+    }
+    else if (name == "region_enabled") {
+        p.ParseBool(config.region_enabled);
+    }
+    else if (name == "region_box") {
+        p.ParseString(config.region_box);
+    }
+    else if (name == "region_entity") {
+        p.ParseString(config.region_entity);
+    }
+    else if (name == "region_margin") {
+        std::string f;
+        if (p.ParseString(f)) {
+            config.region_margin = std::strtod(f.c_str(), nullptr);
+        }
+    }
     else if (name == "use_map_mod") {
         p.ParseBool(config.use_map_mod);
     }
@@ -342,6 +371,12 @@ static void SetConfigVar(Config& config, std::string name, ConfigLineParser& p)
             config.ignore_field_diff.push_back(f);
         }
     }
+    else if (name == "brush_diff_epsilon") {
+        std::string f;
+        if (p.ParseString(f)) {
+            config.brush_diff_epsilon = std::strtod(f.c_str(), nullptr);
+        }
+    }
     else if (name.find("compile_step") != std::string::npos) {
         SetCompileStepVar(name, p, config.steps);
     }
@@ -486,6 +521,7 @@ static void WriteLayerSelection(std::ofstream& fh, const LayerSelection& sel)
     WriteVar(fh, "layer_selection", sel.name);
     WriteVar(fh, "layer_selection_autoselect", sel.auto_select_new_layers);
     WriteVar(fh, "layer_selection_default", sel.default_layer_selected);
+    WriteVar(fh, "layer_selection_variant", sel.build_variant);
     for (const auto& lname : sel.layers) {
         WriteVar(fh, "layer_selection_layer", lname);
     }
@@ -516,6 +552,13 @@ void WriteConfig(const Config& config, const std::string& path)
     WriteVar(fh, "quake_args", config.quake_args);
     WriteVar(fh, "watch_map_file", config.watch_map_file);
     WriteVar(fh, "auto_apply_onlyents", config.auto_apply_onlyents);
+    WriteVar(fh, "patch_entity_lump", config.patch_entity_lump);
+    WriteVar(fh, "verify_entity_lump", config.verify_entity_lump);
+    WriteVar(fh, "normalize_work_map", config.normalize_work_map);
+    WriteVar(fh, "region_enabled", config.region_enabled);
+    WriteVar(fh, "region_box", config.region_box);
+    WriteVar(fh, "region_entity", config.region_entity);
+    WriteVar(fh, "region_margin", std::to_string(config.region_margin));
     WriteVar(fh, "use_map_mod", config.use_map_mod);
     WriteVar(fh, "quake_output_enabled", config.quake_output_enabled);
     WriteVar(fh, "compile_map_on_launch", config.compile_map_on_launch);
@@ -540,6 +583,7 @@ void WriteConfig(const Config& config, const std::string& path)
     for (const auto& f : config.ignore_field_diff) {
         WriteVar(fh, "ignore_field_diff", f);
     }
+    WriteVar(fh, "brush_diff_epsilon", std::to_string(config.brush_diff_epsilon));
     
     // write compile steps
     for (const auto& step : config.steps) {
@@ -555,6 +599,9 @@ void WriteConfig(const Config& config, const std::string& path)
 void SetConfigDefaults(Config& config)
 {
     config.quake_output_enabled = true;
+    config.brush_diff_epsilon = map_file::DEFAULT_BRUSH_EPSILON;
+    config.patch_entity_lump = true;
+    config.region_margin = 256;
     config.ui_section_info_open = true;
     config.ui_section_paths_open = true;
 }
@@ -44,6 +44,8 @@ struct LayerSelection
     bool default_layer_selected;
     std::string name;
     std::vector<std::string> layers;
+    // Built by "Build layer variants", into a work subdir and an output BSP named after the selection.
+    bool build_variant = false;
 };
 
 /// Config can be saved and loaded from the path the user chooses
@@ -58,13 +60,27 @@ struct Config
     std::vector<std::string> custom_brush_light_fields;
     std::vector<std::string> custom_light_entities;
     std::vector<std::string> ignore_field_diff;
+    // Brush numbers closer than this don't count as a change, negative compares the brush text as is.
+    double brush_diff_epsilon;
     std::string quake_args;
     std::string selected_preset;
     std::string selected_layers;
+    // Region compile: only the brushes and entities in a box are compiled, sealed so they don't leak.
+    // The box is the bounds of the entity with region_entity as its targetname, grown by region_margin,
+    // or else region_box as "x1 y1 z1 x2 y2 z2".
+    std::string region_box;
+    std::string region_entity;
+    double region_margin;
 
     bool watch_map_file;
     bool use_map_mod;
     bool auto_apply_onlyents;
+    // Write the entity lump into the BSP instead of running qbsp -onlyents, optionally checked against qbsp.
+    bool patch_entity_lump;
+    bool verify_entity_lump;
+    // Strip comments and TrenchBroom bookkeeping from the work map, see map_file::WriteNormalizedMap.
+    bool normalize_work_map;
+    bool region_enabled;
     bool quake_output_enabled;
     bool compile_map_on_launch;
     bool open_editor_on_launch;
@@ -0,0 +1,141 @@
+#include <cstring>
+#include "hash.h"
+
+namespace hash {
+
+static constexpr std::uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+static constexpr std::uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr std::uint64_t PRIME3 = 0x165667B19E3779F9ull;
+static constexpr std::uint64_t PRIME4 = 0x85EBCA77C2B2AE63ull;
+static constexpr std::uint64_t PRIME5 = 0x27D4EB2F165667C5ull;
+
+static std::uint64_t Rotl(std::uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static std::uint64_t Read64(const unsigned char* p)
+{
+    std::uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static std::uint32_t Read32(const unsigned char* p)
+{
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static std::uint64_t Round(std::uint64_t acc, std::uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = Rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static std::uint64_t MergeRound(std::uint64_t acc, std::uint64_t val)
+{
+    acc ^= Round(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+Hasher::Hasher(std::uint64_t seed) : _seed{ seed }
+{
+    _acc[0] = seed + PRIME1 + PRIME2;
+    _acc[1] = seed + PRIME2;
+    _acc[2] = seed;
+    _acc[3] = seed - PRIME1;
+}
+
+void Hasher::Update(const void* data, std::size_t size)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    _total += size;
+
+    if (_buf_size + size < sizeof(_buf)) {
+        std::memcpy(_buf + _buf_size, p, size);
+        _buf_size += size;
+        return;
+    }
+
+    if (_buf_size) {
+        std::size_t fill = sizeof(_buf) - _buf_size;
+        std::memcpy(_buf + _buf_size, p, fill);
+        p += fill;
+        for (int i = 0; i < 4; i++) {
+            _acc[i] = Round(_acc[i], Read64(_buf + i*8));
+        }
+        _buf_size = 0;
+    }
+
+    for (; p + 32 <= end; p += 32) {
+        _acc[0] = Round(_acc[0], Read64(p));
+        _acc[1] = Round(_acc[1], Read64(p + 8));
+        _acc[2] = Round(_acc[2], Read64(p + 16));
+        _acc[3] = Round(_acc[3], Read64(p + 24));
+    }
+
+    _buf_size = end - p;
+    std::memcpy(_buf, p, _buf_size);
+}
+
+std::uint64_t Hasher::Digest() const
+{
+    std::uint64_t h;
+    if (_total >= 32) {
+        h = Rotl(_acc[0], 1) + Rotl(_acc[1], 7) + Rotl(_acc[2], 12) + Rotl(_acc[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = MergeRound(h, _acc[i]);
+        }
+    }
+    else {
+        h = _seed + PRIME5;
+    }
+    h += _total;
+
+    const unsigned char* p = _buf;
+    const unsigned char* end = _buf + _buf_size;
+    for (; p + 8 <= end; p += 8) {
+        h ^= Round(0, Read64(p));
+        h = Rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= std::uint64_t(Read32(p)) * PRIME1;
+        h = Rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * PRIME5;
+        h = Rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+std::uint64_t Hash(std::string_view str, std::uint64_t seed)
+{
+    Hasher hasher{ seed };
+    hasher.Update(str);
+    return hasher.Digest();
+}
+
+std::uint64_t Mix(std::uint64_t value)
+{
+    std::uint64_t h = (value + PRIME5) * PRIME1;
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+}
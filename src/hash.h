@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+namespace hash {
+
+/// Streaming 64-bit hash (XXH64), feeding the same bytes in any number of pieces gives the same digest.
+struct Hasher
+{
+    explicit Hasher(std::uint64_t seed = 0);
+
+    void Update(const void* data, std::size_t size);
+
+    void Update(std::string_view str) { Update(str.data(), str.size()); }
+
+    void UpdateU64(std::uint64_t value) { Update(&value, sizeof(value)); }
+
+    /// Hashes the length before the bytes, so consecutive strings can't run into each other.
+    void UpdateString(std::string_view str) { UpdateU64(str.size()); Update(str); }
+
+    std::uint64_t Digest() const;
+
+    std::uint64_t _acc[4];
+    std::uint64_t _seed;
+    std::uint64_t _total = 0;
+    unsigned char _buf[32];
+    std::size_t _buf_size = 0;
+};
+
+std::uint64_t Hash(std::string_view str, std::uint64_t seed = 0);
+
+/// Spreads every bit of the value over the whole result. Summing mixed digests gives a hash of a
+/// multiset, which doesn't depend on the order its elements are added in.
+std::uint64_t Mix(std::uint64_t value);
+
+}
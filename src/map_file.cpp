@@ -1,33 +1,251 @@
+#include <algorithm>
 #include <array>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
 #include <string_view>
+#include <thread>
+#include <unordered_set>
+#include "hash.h"
 #include "map_file.h"
 #include "path.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MAP_FILE_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MAP_FILE_SSE2 1
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 namespace map_file {
 
-struct MapFileParser
+static unsigned int CountTrailingZeros(std::uint64_t mask)
+{
+#if defined(_MSC_VER)
+    unsigned long idx;
+    if (_BitScanForward(&idx, (unsigned long)(mask & 0xffffffff))) {
+        return idx;
+    }
+    _BitScanForward(&idx, (unsigned long)(mask >> 32));
+    return idx + 32;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+/// Counts the newlines 16 bytes at a time, the byte-wise counts are summed up before they can overflow.
+static std::size_t CountNewlines(const char* p, std::size_t size)
+{
+    std::size_t count = 0;
+#if defined(MAP_FILE_AVX2) || defined(MAP_FILE_SSE2)
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (size >= 16) {
+        std::size_t blocks = std::min<std::size_t>(size / 16, 255);
+        __m128i counts = _mm_setzero_si128();
+        for (std::size_t i = 0; i < blocks; i++, p += 16) {
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), newline));
+        }
+        __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+        count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+        size -= blocks * 16;
+    }
+#endif
+    for (; size > 0; size--, p++) {
+        count += (*p == '\n');
+    }
+    return count;
+}
+
+/// Dialect policies for MapTokenizer, chosen once per map from DetectMapDialect.
+/// Standard and Valve 220 maps share a tokenizer, it never looks inside brushes.
+struct IdDialect
+{
+    // Without comments nothing between entities matters, so '/' isn't a structural character.
+    static constexpr bool COMMENTS = false;
+};
+
+struct TrenchBroomDialect
+{
+    static constexpr bool COMMENTS = true;
+};
+
+template<bool Comments>
+static bool IsStructuralChar(char c)
+{
+    return (c == '"') || (c == '{') || (c == '}') || (Comments && c == '/');
+}
+
+/// Locates the only characters the parser state machine reacts to ('"', '{', '}' and, for maps
+/// with comments, '/'), 64 bytes at a time, so the parser can jump between them instead of
+/// visiting every byte.
+template<bool Comments>
+struct StructuralScanner
 {
-    explicit MapFileParser(std::string_view text)
+    enum { BLOCK_SIZE = 64 };
+
+    explicit StructuralScanner(std::string_view text) : _text{ text } {}
+
+    /// Returns the offset of the first structural character at or after offs, or the text size.
+    std::size_t Next(std::size_t offs)
+    {
+        while (offs < _text.size()) {
+            std::size_t block = offs & ~std::size_t(BLOCK_SIZE - 1);
+            if (block != _block) {
+                _block = block;
+                _mask = ClassifyBlock(block);
+            }
+
+            std::uint64_t mask = _mask >> (offs - block);
+            if (mask) {
+                return offs + CountTrailingZeros(mask);
+            }
+            offs = block + BLOCK_SIZE;
+        }
+        return _text.size();
+    }
+
+    std::uint64_t ClassifyBlock(std::size_t block) const
+    {
+        const char* p = _text.data() + block;
+        if (_text.size() - block < BLOCK_SIZE) {
+            std::uint64_t mask = 0;
+            for (std::size_t i = 0; i < _text.size() - block; i++) {
+                if (IsStructuralChar<Comments>(p[i])) mask |= std::uint64_t(1) << i;
+            }
+            return mask;
+        }
+
+#if defined(MAP_FILE_AVX2)
+        const __m256i quote = _mm256_set1_epi8('"');
+        const __m256i lbrace = _mm256_set1_epi8('{');
+        const __m256i rbrace = _mm256_set1_epi8('}');
+        const __m256i slash = _mm256_set1_epi8('/');
+
+        std::uint64_t mask = 0;
+        for (int i = 0; i < BLOCK_SIZE; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, lbrace), _mm256_cmpeq_epi8(v, rbrace)));
+            if (Comments) {
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, slash));
+            }
+            mask |= std::uint64_t(std::uint32_t(_mm256_movemask_epi8(m))) << i;
+        }
+        return mask;
+#elif defined(MAP_FILE_SSE2)
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i lbrace = _mm_set1_epi8('{');
+        const __m128i rbrace = _mm_set1_epi8('}');
+        const __m128i slash = _mm_set1_epi8('/');
+
+        std::uint64_t mask = 0;
+        for (int i = 0; i < BLOCK_SIZE; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                _mm_or_si128(_mm_cmpeq_epi8(v, lbrace), _mm_cmpeq_epi8(v, rbrace)));
+            if (Comments) {
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, slash));
+            }
+            mask |= std::uint64_t(std::uint32_t(_mm_movemask_epi8(m)) & 0xffff) << i;
+        }
+        return mask;
+#else
+        // SWAR fallback: test 8 bytes per word for each structural character.
+        std::uint64_t mask = 0;
+        for (int i = 0; i < BLOCK_SIZE; i += 8) {
+            std::uint64_t word;
+            std::memcpy(&word, p + i, sizeof(word));
+            std::uint64_t m = ZeroBytes(word ^ Broadcast('"')) | ZeroBytes(word ^ Broadcast('{')) | ZeroBytes(word ^ Broadcast('}'));
+            if (Comments) {
+                m |= ZeroBytes(word ^ Broadcast('/'));
+            }
+            mask |= (((m >> 7) * 0x0102040810204080ull) >> 56) << i;
+        }
+        return mask;
+#endif
+    }
+
+    static constexpr std::uint64_t Broadcast(char c)
+    {
+        return std::uint64_t(std::uint8_t(c)) * 0x0101010101010101ull;
+    }
+
+    /// Sets the high bit of every zero byte in the (little-endian) word.
+    static std::uint64_t ZeroBytes(std::uint64_t word)
     {
-        _text = text;
-        Parse();
+        const std::uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+        return ~(((word & low7) + low7) | word | low7);
     }
 
-    void Parse()
+    std::string_view _text;
+    std::size_t _block = ~std::size_t(0);
+    std::uint64_t _mask = 0;
+};
+
+/// The map state machine, reporting what it finds to a Sink with EntityBegin(offset), Field(key, value),
+/// Brush(content) and EntityEnd() members. Offsets are kept instead of views, so the text
+/// can be a sliding window over a file (see StreamMapFile).
+///
+/// With a Dialect without comments, a '/' between two entities stops the tokenizer with
+/// _dialect_mismatch set, the map has to be tokenized again with comments then.
+template<class Sink, class Dialect>
+struct MapTokenizer
+{
+    enum State
+    {
+        Default,
+        Entity1,
+        Entity2,
+        FieldKey,
+        FieldValue,
+        Brushes,
+        Comment,
+    };
+
+    explicit MapTokenizer(Sink& sink) : _sink{ sink } {}
+
+    /// Runs the state machine over text from offs and returns where it stopped. That is the end of
+    /// the text, except when more text follows (final == false) and the text ends on a '/' that may
+    /// start a comment, then it stops on the '/'.
+    std::size_t Run(std::string_view text, std::size_t offs, bool final)
     {
-        for (;_offs < _text.size(); _offs++) {
-            char c = _text[_offs];
-            char cn = (_offs < _text.size()-1) ? _text[_offs+1] : 0;
+        // Every state transition below happens on a structural character, so skip everything else.
+        StructuralScanner<Dialect::COMMENTS> scanner{ text };
+
+        if (Dialect::COMMENTS && _state == Comment) {
+            offs = SkipComment(text, offs);
+        }
+
+        for (offs = scanner.Next(offs); offs < text.size(); offs = scanner.Next(offs + 1)) {
+            char c = text[offs];
 
             switch (_state) {
             case Default: {
-                if (c == '/' && cn == '/') {
-                    _state = Comment;
-                    _offs++;
+                if (Dialect::COMMENTS && c == '/') {
+                    if (offs == text.size()-1 && !final) {
+                        return offs;
+                    }
+                    if ((offs < text.size()-1) && text[offs+1] == '/') {
+                        _state = Comment;
+                        // comments end on the next newline, which is no structural character, so find it directly
+                        offs = SkipComment(text, offs + 2) - 1;
+                    }
                 }
                 else if (c == '{') {
+                    if (!Dialect::COMMENTS && HasSlash(text, _gap_begin, offs)) {
+                        _dialect_mismatch = true;
+                        return text.size();
+                    }
                     _state = Entity1;
-                    _entities.push_back({});
+                    _sink.EntityBegin(offs);
                 }
                 break;
             }
@@ -35,14 +253,16 @@ struct MapFileParser
             case Entity1: {
                 if (c == '"') {
                     _state = FieldKey;
-                    _field_begin = _offs + 1;
+                    _token_begin = offs + 1;
                 }
                 else if (c == '{') {
                     _state = Brushes;
-                    _field_begin = _offs + 1;
+                    _token_begin = offs + 1;
                 }
                 else if (c == '}') {
                     _state = Default;
+                    _gap_begin = offs + 1;
+                    _sink.EntityEnd();
                 }
                 break;
             }
@@ -50,7 +270,7 @@ struct MapFileParser
             case Entity2: {
                 if (c == '"') {
                     _state = FieldValue;
-                    _field_begin = _offs + 1;
+                    _value_begin = offs + 1;
                 }
                 break;
             }
@@ -58,7 +278,7 @@ struct MapFileParser
             case FieldKey: {
                 if (c == '"') {
                     _state = Entity2;
-                    _field_key = std::string_view(_text.data()+_field_begin, _offs - _field_begin);
+                    _key_end = offs;
                 }
                 break;
             }
@@ -66,8 +286,10 @@ struct MapFileParser
             case FieldValue: {
                 if (c == '"') {
                     _state = Entity1;
-                    _field_value = std::string_view(_text.data()+_field_begin, _offs - _field_begin);
-                    _entities.back().fields[_field_key] = _field_value;
+                    _sink.Field(
+                        std::string_view(text.data() + _token_begin, _key_end - _token_begin),
+                        std::string_view(text.data() + _value_begin, offs - _value_begin)
+                    );
                 }
                 break;
             }
@@ -75,279 +297,1660 @@ struct MapFileParser
             case Brushes: {
                 if (c == '}') {
                     _state = Entity1;
-                    _entities.back().brush_content.push_back(std::string_view(_text.data() + _field_begin, _offs - _field_begin));
+                    _sink.Brush(std::string_view(text.data() + _token_begin, offs - _token_begin));
                 }
                 break;
             }
 
             case Comment:
-                if (c == '\n') {
-                    _state = Default;
-                }
                 break;
             }
         }
+
+        // A comment after the last entity would have hidden a '{' from a later slice of the map.
+        if (!Dialect::COMMENTS && final && _state == Default && HasSlash(text, _gap_begin, text.size())) {
+            _dialect_mismatch = true;
+        }
+        return text.size();
     }
 
-    enum State
+    /// Leaves the Comment state on the newline at or after offs and returns the offset past it,
+    /// or returns the text size if the comment doesn't end in the text.
+    std::size_t SkipComment(std::string_view text, std::size_t offs)
     {
-        Default,
-        Entity1,
-        Entity2,
-        FieldKey,
-        FieldValue,
-        Brushes,
-        Comment,
-    };
+        std::size_t newline = text.find('\n', offs);
+        if (newline == std::string_view::npos) {
+            return text.size();
+        }
+        _state = Default;
+        return newline + 1;
+    }
 
-    std::string_view _text;
-    std::string_view _field_key;
-    std::string_view _field_value;
-    std::vector<MapEntity> _entities;
-    std::size_t _offs = 0;
-    std::size_t _field_begin = 0;
+    static bool HasSlash(std::string_view text, std::size_t begin, std::size_t end)
+    {
+        return begin < end && std::memchr(text.data() + begin, '/', end - begin) != nullptr;
+    }
+
+    /// Closes an unterminated last entity.
+    void Finish()
+    {
+        if (_state != Default && _state != Comment) {
+            _sink.EntityEnd();
+        }
+    }
+
+    /// Returns the first offset of the field or brush in progress, which must stay in the text.
+    std::size_t PendingBegin(std::size_t offs) const
+    {
+        switch (_state) {
+        case FieldKey:
+        case Entity2:
+        case FieldValue:
+        case Brushes:
+            return _token_begin;
+        default:
+            return offs;
+        }
+    }
+
+    /// Moves the offsets back after the text before them was dropped.
+    void Rebase(std::size_t shift)
+    {
+        _token_begin -= std::min(_token_begin, shift);
+        _key_end -= std::min(_key_end, shift);
+        _value_begin -= std::min(_value_begin, shift);
+        _gap_begin -= std::min(_gap_begin, shift);
+    }
+
+    Sink& _sink;
+    std::size_t _token_begin = 0;
+    std::size_t _key_end = 0;
+    std::size_t _value_begin = 0;
+    // Where the text between the last entity and the next one starts.
+    std::size_t _gap_begin = 0;
     State _state = Default;
+    bool _dialect_mismatch = false;
 };
 
-static bool Contains(std::string_view hay, std::string_view ned)
+template<class Dialect>
+struct MapFileParser
 {
-    return hay.find(ned) != std::string::npos;
-}
+    explicit MapFileParser(std::string_view text) : _text{ text }
+    {
+        MapTokenizer<MapFileParser, Dialect> tokenizer{ *this };
+        tokenizer.Run(text, 0, true);
+        tokenizer.Finish();
+        _dialect_mismatch = tokenizer._dialect_mismatch;
+        _complete = !_dialect_mismatch && (tokenizer._state == MapTokenizer<MapFileParser, Dialect>::Default);
+    }
 
-static bool ShouldIgnoreFieldForDiff(std::string_view field, const std::vector<std::string>& ignore_field_diff)
-{
-    for (const auto& custom_field : ignore_field_diff) {
-        if (field == custom_field) {
-            return true;
+    void EntityBegin(std::size_t offset)
+    {
+        _entities.push_back({});
+        _entities.back().field_begin = static_cast<std::uint32_t>(_fields.size());
+        _entities.back().offset = offset;
+        _entities.back().brush_begin = static_cast<std::uint32_t>(_brush_offsets.size());
+    }
+
+    void Field(std::string_view key, std::string_view value)
+    {
+        _fields.push_back(MapField{ _atoms.Intern(key), key, value });
+    }
+
+    void Brush(std::string_view content)
+    {
+        _entities.back().brush_content.push_back(content);
+        _brush_offsets.push_back(content.data() - 1 - _text.data());
+    }
+
+    /// Sorts the fields of the last entity by key and drops duplicate keys, keeping the last value.
+    void EntityEnd()
+    {
+        auto& ent = _entities.back();
+        MapField* begin = _fields.data() + ent.field_begin;
+        MapField* end = _fields.data() + _fields.size();
+
+        // stable insertion sort, entities rarely have more than a dozen fields
+        for (MapField* it = begin + 1; it < end; it++) {
+            MapField field = *it;
+            MapField* j = it;
+            for (; j > begin && field.key < (j - 1)->key; j--) {
+                *j = *(j - 1);
+            }
+            *j = field;
+        }
+
+        MapField* out = begin;
+        for (MapField* it = begin; it < end; it++) {
+            if ((it + 1) < end && (it + 1)->atom == it->atom) continue;
+            *out++ = *it;
         }
+
+        _fields.resize(out - _fields.data());
+        ent.field_count = static_cast<std::uint32_t>(out - begin);
     }
-    return (
-        (field == "_tb_group") || (field == "_tb_id")
-    );
-}
 
-static bool IsWorldspawnLightField(std::string_view field, const std::vector<std::string>& custom_worldspawn_light_fields)
-{
-    static const char* light_fields[] = {
-        // Ambient Occlusion options
-        "_dirt", "_dirtmode", "_dirtscale", "_dirtgain", "_dirtdepth", "_dirtangle",
+    std::string_view _text;
+    std::vector<MapEntity> _entities;
+    std::vector<MapField> _fields;
+    std::vector<std::size_t> _brush_offsets;
+    AtomTable _atoms;
+
+    // Whether the text ended outside of any entity, string or comment.
+    bool _complete = false;
 
-        // Bounce lighting options
-        "_bounce", "_bouncescale", "_bouncecolorscale", "_bouncestyled",
+    // Whether the text has comments the dialect doesn't handle, the results are incomplete then.
+    bool _dialect_mismatch = false;
+};
 
-        // Sun options
-        "_sunlight", "_sunlight_color", "_sunlight_mangle", "_anglescale", "_sunlight_dirt", "_sunlight_penumbra",
-        "_sunlight2", "_sunlight2_color", "_sunlight2_dirt",
-        "_sunlight3", "_sunlight3_color",
+// Maps smaller than this are parsed on the calling thread.
+static constexpr std::size_t PARALLEL_PARSE_MIN_SIZE = 8 * 1024 * 1024;
 
-        // World lighting options
-        "_minlight", "_minlight_color", "_minlight_dirt", "_range", "_dist", "_gamma", "_spotlightautofalloff"
-    };
+// Don't bother spawning a thread for less than this much text.
+static constexpr std::size_t PARALLEL_PARSE_MIN_SLICE = 2 * 1024 * 1024;
 
-    const size_t count = sizeof(light_fields) / sizeof(const char*);
-    for (size_t i = 0; i < count; i++) {
-        if (field == light_fields[i]) {
-            return true;
+/// Returns the offset just past a '}' at or after offs that most likely closes a top-level entity
+/// (preceded by another '}' or by a field value), or the text size if there's none.
+static std::size_t FindEntityBoundary(std::string_view text, std::size_t offs)
+{
+    for (;;) {
+        offs = text.find('}', offs);
+        if (offs == std::string_view::npos) {
+            return text.size();
         }
-        for (const auto& custom_field : custom_worldspawn_light_fields) {
-            if (field == custom_field) {
-                return true;
-            }
+
+        std::size_t prev = offs;
+        while (prev > 0 && std::isspace(static_cast<unsigned char>(text[prev - 1]))) {
+            prev--;
+        }
+        if (prev > 0 && (text[prev - 1] == '}' || text[prev - 1] == '"')) {
+            return offs + 1;
         }
+        offs++;
     }
-
-    return false;
 }
 
-static bool IsBrushEntityLightField(std::string_view field, const std::vector<std::string>& custom_brush_light_fields)
+/// Parses a large map in slices on multiple threads and merges the results in order.
+/// Returns false if the slices couldn't be parsed independently, the caller should parse sequentially then.
+template<class Dialect>
+static bool ParseParallel(std::string_view text, MapFile& map)
 {
-    static const char* light_fields[] = {
-        "_minlight", "_minlight_color", "_lightignore", "_minlight_exclude",
-        "_shadow", "_shadowself", "_shadowworldonly", "_phong", "_phong_angle", "_phong_angle_concave", "_dirt"
-    };
+    std::size_t num_slices = std::min<std::size_t>(std::thread::hardware_concurrency(), text.size() / PARALLEL_PARSE_MIN_SLICE);
+    if (num_slices < 2) {
+        return false;
+    }
+
+    // Slice boundaries are only guesses, a boundary is valid if the slice before it ends outside of any entity,
+    // the state machine carries nothing else from one entity to the next.
+    std::vector<std::size_t> bounds{ 0 };
+    for (std::size_t i = 1; i < num_slices; i++) {
+        std::size_t b = FindEntityBoundary(text, std::max(bounds.back(), text.size() * i / num_slices));
+        if (b >= text.size()) break;
+        bounds.push_back(b);
+    }
+    bounds.push_back(text.size());
 
-    const size_t count = sizeof(light_fields) / sizeof(const char*);
-    for (size_t i = 0; i < count; i++) {
-        if (field == light_fields[i]) {
-            return true;
+    std::vector<std::unique_ptr<MapFileParser<Dialect>>> parsers(bounds.size() - 1);
+    {
+        std::vector<std::thread> threads;
+        for (std::size_t i = 1; i < parsers.size(); i++) {
+            threads.emplace_back([&parsers, &bounds, text, i]() {
+                parsers[i] = std::make_unique<MapFileParser<Dialect>>(text.substr(bounds[i], bounds[i + 1] - bounds[i]));
+            });
         }
-        for (const auto& custom_field : custom_brush_light_fields) {
-            if (field == custom_field) {
-                return true;
-            }
+        parsers[0] = std::make_unique<MapFileParser<Dialect>>(text.substr(0, bounds[1]));
+        for (auto& t : threads) {
+            t.join();
         }
     }
 
-    return false;
-}
+    for (std::size_t i = 0; i < parsers.size(); i++) {
+        if (parsers[i]->_dialect_mismatch || (i < parsers.size() - 1 && !parsers[i]->_complete)) {
+            return false;
+        }
+    }
 
-static bool IsCustomLightEntity(std::string_view classname, const std::vector<std::string>& custom_light_entities)
-{
-    for (const auto& c : custom_light_entities) {
-        if (classname == c) {
-            return true;
+    std::size_t num_entities = 0;
+    std::size_t num_fields = 0;
+    std::size_t num_brushes = 0;
+    for (const auto& parser : parsers) {
+        num_entities += parser->_entities.size();
+        num_fields += parser->_fields.size();
+        num_brushes += parser->_brush_offsets.size();
+    }
+
+    map._entities = std::move(parsers[0]->_entities);
+    map._fields = std::move(parsers[0]->_fields);
+    map._brush_offsets = std::move(parsers[0]->_brush_offsets);
+    map._atoms = std::move(parsers[0]->_atoms);
+    map._entities.reserve(num_entities);
+    map._fields.reserve(num_fields);
+    map._brush_offsets.reserve(num_brushes);
+
+    std::vector<Atom> atom_remap;
+    for (std::size_t i = 1; i < parsers.size(); i++) {
+        auto& parser = *parsers[i];
+
+        atom_remap.resize(parser._atoms._names.size());
+        for (std::size_t a = 0; a < atom_remap.size(); a++) {
+            atom_remap[a] = map._atoms.Intern(parser._atoms._names[a]);
+        }
+
+        // slice offsets are relative to the slice
+        auto field_offset = static_cast<std::uint32_t>(map._fields.size());
+        auto brush_offset = static_cast<std::uint32_t>(map._brush_offsets.size());
+        for (auto& ent : parser._entities) {
+            ent.field_begin += field_offset;
+            ent.brush_begin += brush_offset;
+            ent.offset += bounds[i];
+            map._entities.push_back(std::move(ent));
+        }
+        for (auto& field : parser._fields) {
+            field.atom = atom_remap[field.atom];
+            map._fields.push_back(field);
+        }
+        for (std::size_t offset : parser._brush_offsets) {
+            map._brush_offsets.push_back(offset + bounds[i]);
         }
     }
-    return false;
+    return true;
 }
 
-MapFile::MapFile(const std::string& path)
+struct MapVisitorSink
 {
-    path::ReadFileText(path, _text);
+    void EntityBegin(std::size_t) { _visitor.EntityBegin(); }
+    void Field(std::string_view key, std::string_view value) { _visitor.Field(key, value); }
+    void Brush(std::string_view content) { _visitor.Brush(content); }
+    void EntityEnd() { _visitor.EntityEnd(); }
 
-    MapFileParser parser{ _text };
-    _entities = std::move(parser._entities);
+    MapVisitor& _visitor;
+};
 
-    // look for layer entities
-    for (auto& ent : _entities) {
-        if (ent.fields["classname"] == "func_group" && ent.fields["_tb_type"] == "_tb_layer") {
-            _layers.push_back(MapLayer{std::string{ent.fields["_tb_name"]}, std::string{ent.fields["_tb_id"]}});
+bool StreamMapFile(const std::string& path, MapVisitor& visitor, std::size_t chunk_size)
+{
+    std::FILE* const fh = path::OpenFile(path, "rb");
+    if (!fh) {
+        return false;
+    }
+
+    // The dialect can't be switched halfway through a stream, so handle comments everywhere.
+    MapVisitorSink sink{ visitor };
+    MapTokenizer<MapVisitorSink, TrenchBroomDialect> tokenizer{ sink };
+
+    // The buffer holds the unparsed tail of the previous chunks followed by the new chunk,
+    // so it only grows beyond a chunk for a single field or brush larger than that.
+    std::vector<char> buf;
+    std::size_t offs = 0;
+    for (;;) {
+        std::size_t size = buf.size();
+        buf.resize(size + chunk_size);
+        std::size_t read = std::fread(buf.data() + size, 1, chunk_size, fh);
+        buf.resize(size + read);
+
+        bool final = (read < chunk_size);
+        offs = tokenizer.Run(std::string_view(buf.data(), buf.size()), offs, final);
+        if (final) {
+            break;
         }
+
+        std::size_t keep = tokenizer.PendingBegin(offs);
+        buf.erase(buf.begin(), buf.begin() + keep);
+        tokenizer.Rebase(keep);
+        offs -= keep;
     }
+    tokenizer.Finish();
+
+    std::fclose(fh);
+    return true;
 }
 
-std::string MapFile::GetTBMod() const {
-    if (!_entities.size()) {
-        return "";
-    }
+void VisitMapText(std::string_view text, MapVisitor& visitor)
+{
+    MapVisitorSink sink{ visitor };
+    MapTokenizer<MapVisitorSink, TrenchBroomDialect> tokenizer{ sink };
+    tokenizer.Run(text, 0, true);
+    tokenizer.Finish();
+}
 
-    auto it = _entities[0].fields.find("_tb_mod");
-    if (it == _entities[0].fields.end()) {
-        return "";
+MapLayerFilter FilterMapLayers(const MapFile& map, const std::vector<std::string>& layer_names, bool default_layer)
+{
+    std::unordered_set<std::string_view> layer_ids;
+    for (const auto& layer : map._layers) {
+        if (std::find(layer_names.begin(), layer_names.end(), layer.name) != layer_names.end()) {
+            layer_ids.insert(layer.id);
+        }
     }
 
-    auto str = std::string(it->second);
-    auto pos = str.find(';');
-    if (pos != std::string::npos) {
-        return str.substr(0, pos);
-    }
-    else {
-        return str;
+    std::unordered_map<std::string_view, const MapEntity*> groups;
+    for (const auto& ent : map._entities) {
+        if (map.GetField(ent, ATOM_TB_TYPE) == "_tb_group") {
+            groups.emplace(map.GetField(ent, ATOM_TB_ID), &ent);
+        }
     }
-}
 
-std::string MapFile::GetBrushContent() const {
-    std::string buf;
-    for (const auto& ent : _entities) {
-        for (const auto& content : ent.brush_content) {
-            buf.append(content);
-        }
+    // the ids sorted, so the hash doesn't depend on the order of the layers
+    std::vector<std::string_view> sorted_ids(layer_ids.begin(), layer_ids.end());
+    std::sort(sorted_ids.begin(), sorted_ids.end());
+    hash::Hasher selection;
+    selection.UpdateU64(default_layer);
+    for (std::string_view id : sorted_ids) {
+        selection.UpdateString(id);
     }
-    return buf;
-}
 
-std::string MapFile::GetEntityContent(const std::vector<std::string>& ignore_field_diff) const {
-    std::string buf;
-    for (const auto& ent : _entities) {
-        auto classname_it = ent.fields.find("classname");
-        if (classname_it == ent.fields.end()) {
+    MapLayerFilter filter;
+    filter.world_brushes = default_layer;
+    filter.hash = selection.Digest();
+    filter.entities.reserve(map._entities.size());
+    for (const auto& ent : map._entities) {
+        std::string_view classname = map.GetField(ent, ATOM_CLASSNAME);
+        std::string_view layer;
+        if (classname == "worldspawn") {
+            filter.entities.push_back(true);
             continue;
         }
-
-        if (!Contains(classname_it->second, "light")) {
-            for (const auto& field : ent.fields) {
-                if (!ShouldIgnoreFieldForDiff(field.first, ignore_field_diff)) {
-                    buf.append(field.first);
-                    buf.append(field.second);
-                }
+        if (map.GetField(ent, ATOM_TB_TYPE) == "_tb_layer") {
+            layer = map.GetField(ent, ATOM_TB_ID);
+        }
+        else {
+            // groups only have a layer at the outermost level, the bound stops cycles
+            const MapEntity* e = &ent;
+            for (std::size_t depth = 0; depth <= groups.size(); depth++) {
+                layer = map.GetField(*e, ATOM_TB_LAYER);
+                auto it = groups.find(map.GetField(*e, ATOM_TB_GROUP));
+                if (!layer.empty() || it == groups.end()) break;
+                e = it->second;
             }
         }
+        filter.entities.push_back(layer.empty() ? default_layer : layer_ids.count(layer) > 0);
     }
-    return buf;
+    return filter;
 }
 
-std::string MapFile::GetLightContent(
-    const std::vector<std::string>& custom_worldspawn_light_fields,
-    const std::vector<std::string>& custom_brush_light_fields,
-    const std::vector<std::string>& custom_light_entities,
-    const std::vector<std::string>& ignore_field_diff
-) const {
-    std::string buf;
-    for (const auto& ent : _entities) {
-        auto classname_it = ent.fields.find("classname");
-        if (classname_it == ent.fields.end()) {
-            continue;
+static bool IsWorldClass(std::string_view classname)
+{
+    return classname == "worldspawn" || classname == "func_group";
+}
+
+/// Pieces of map text and generated strings, written out in order. Pieces that follow each other in
+/// the map text are merged, so a whole map is a few writes.
+struct MapTextSpans
+{
+    explicit MapTextSpans(std::string_view text) : _text(text) {}
+
+    void Add(std::size_t begin, std::size_t end)
+    {
+        if (begin >= end) return;
+        if (!_spans.empty() && _spans.back().data() + _spans.back().size() == _text.data() + begin) {
+            _spans.back() = std::string_view(_spans.back().data(), _spans.back().size() + end - begin);
         }
+        else {
+            _spans.push_back(_text.substr(begin, end - begin));
+        }
+    }
 
-        if ((Contains(classname_it->second, "light") && (ent.brush_content.size() == 0))
-            || IsCustomLightEntity(classname_it->second, custom_light_entities)) {
-            // Check light entity fields
-            for (const auto& field : ent.fields) {
-                if (!ShouldIgnoreFieldForDiff(field.first, ignore_field_diff)) {
-                    buf.append(field.first);
-                    buf.append(field.second);
-                }
-            }
+    /// The string has to outlive the spans.
+    void Push(std::string_view str) { _spans.push_back(str); }
+
+    bool Write(const std::string& path) const
+    {
+        std::FILE* const fh = path::OpenFile(path, "wb");
+        if (!fh) {
+            return false;
         }
 
-        if (ent.brush_content.size() > 0) {
-            // Check light-related fields for brush entities
-            for (const auto& field : ent.fields) {
-                if (IsBrushEntityLightField(field.first, custom_brush_light_fields)) {
-                    buf.append(field.first);
-                    buf.append(field.second);
-                }
-            }
+        // The spans are written as they are, no need to copy them into a buffer first
+        std::setvbuf(fh, nullptr, _IONBF, 0);
+        bool written = true;
+        for (auto span : _spans) {
+            written = written && std::fwrite(span.data(), 1, span.size(), fh) == span.size();
         }
+        return (std::fclose(fh) == 0) && written;
+    }
 
-        if (classname_it->second == "worldspawn") {
-            // Check light-related fields for the worldspawn entity
-            for (const auto& field : ent.fields) {
-                if (IsWorldspawnLightField(field.first, custom_worldspawn_light_fields)) {
-                    buf.append(field.first);
-                    buf.append(field.second);
-                }
+    std::string_view _text;
+    std::vector<std::string_view> _spans;
+};
+
+static constexpr std::string_view CLOSE_ENTITY = "}\n";
+
+bool WriteWorkMap(const MapFile& map, const MapDigests* digests, const MapLayerFilter* filter, const std::string& path)
+{
+    const std::string_view text = map._text;
+    std::string field;
+    if (digests) {
+        field.append(" \"").append(MAP_DIGEST_FIELD).append("\" \"").append(FormatDigests(*digests)).append("\"");
+    }
+
+    MapTextSpans spans{ text };
+    bool world_found = false;
+    spans.Add(0, map._entities.empty() ? text.size() : map._entities.front().offset);
+    for (std::size_t i = 0; i < map._entities.size(); i++) {
+        const auto& ent = map._entities[i];
+        std::size_t end = (i + 1 < map._entities.size()) ? map._entities[i + 1].offset : text.size();
+        if (!world_found && map.GetField(ent, ATOM_CLASSNAME) == "worldspawn") {
+            world_found = true;
+            spans.Add(ent.offset, ent.offset + 1);
+            if (!field.empty()) {
+                spans.Push(field);
+            }
+            if (!filter || filter->world_brushes || ent.brush_content.empty()) {
+                spans.Add(ent.offset + 1, end);
             }
+            else {
+                // the fields come before the brushes
+                spans.Add(ent.offset + 1, map._brush_offsets[ent.brush_begin]);
+                spans.Push(CLOSE_ENTITY);
+            }
+        }
+        else if (!filter || filter->entities[i]) {
+            spans.Add(ent.offset, end);
         }
     }
-    return buf;
+    return spans.Write(path);
 }
 
-static std::string GetDiffFlagName(MapDiffFlags f)
+bool IsEditorKey(std::string_view key)
 {
-    switch (f) {
-    case MAP_DIFF_BRUSHES:
-        return "brushes";
-    case MAP_DIFF_ENTS:
-        return "ents";
-    case MAP_DIFF_LIGHTS:
-        return "lights";
-    }
-    return "none";
+    return key.substr(0, 4) == "_tb_";
 }
 
-static MapDiffFlags GetFlagForDiffContent(const std::string& ca, const std::string& cb, MapDiffFlags flag)
+/// A func_group with nothing but TrenchBroom bookkeeping, like the ones of layers and groups.
+static bool IsEditorGroup(const MapFile& map, const MapEntity& ent)
 {
-#if 0
-    std::string fna = GetDiffFlagName(flag) + "_a.txt";
-    std::string fnb = GetDiffFlagName(flag) + "_b.txt";
-    WriteFileText(fna, ca);
-    WriteFileText(fnb, cb);
-#endif
-
-    if (ca != cb) {
-        return flag;
+    if (map.GetField(ent, ATOM_CLASSNAME) != "func_group") {
+        return false;
     }
-    else {
-        return MAP_DIFF_NONE;
+    for (const auto& field : map.Fields(ent)) {
+        if (field.atom != ATOM_CLASSNAME && !IsEditorKey(field.key)) {
+            return false;
+        }
     }
+    return true;
 }
 
-MapDiffFlags GetDiffFlags(const MapFile& a, const MapFile& b,
-    const std::vector<std::string>& custom_worldspawn_light_fields,
-    const std::vector<std::string>& custom_brush_light_fields,
-    const std::vector<std::string>& custom_light_entities,
-    const std::vector<std::string>& ignore_field_diff
-)
+/// Writes map text through a fixed-size buffer, hashing what goes through it.
+struct NormalizedMapWriter
 {
-    std::string a_light = a.GetLightContent(custom_worldspawn_light_fields, custom_brush_light_fields, custom_light_entities, ignore_field_diff);
-    std::string b_light = b.GetLightContent(custom_worldspawn_light_fields, custom_brush_light_fields, custom_light_entities, ignore_field_diff);
+    static constexpr std::size_t BUFFER_SIZE = 1024 * 1024;
 
-    MapDiffFlags flags = MAP_DIFF_NONE;
-    flags |= GetFlagForDiffContent(a.GetBrushContent(), b.GetBrushContent(), MAP_DIFF_BRUSHES);
-    flags |= GetFlagForDiffContent(a.GetEntityContent(ignore_field_diff), b.GetEntityContent(ignore_field_diff), MAP_DIFF_ENTS);
-    flags |= GetFlagForDiffContent(a_light, b_light, MAP_DIFF_LIGHTS);
-    return flags;
-}
+    explicit NormalizedMapWriter(std::FILE* fh) : _fh{ fh } { _buffer.reserve(BUFFER_SIZE); }
+
+    void Write(std::string_view str, bool hashed = true)
+    {
+        if (hashed) {
+            _hasher.Update(str);
+        }
+        if (_buffer.size() + str.size() > BUFFER_SIZE) {
+            Flush();
+        }
+        if (str.size() >= BUFFER_SIZE) {
+            _good = _good && std::fwrite(str.data(), 1, str.size(), _fh) == str.size();
+        }
+        else {
+            _buffer.append(str);
+        }
+    }
+
+    void Flush()
+    {
+        _good = _good && std::fwrite(_buffer.data(), 1, _buffer.size(), _fh) == _buffer.size();
+        _buffer.clear();
+    }
+
+    void Field(std::string_view key, std::string_view value)
+    {
+        Write("\"");
+        Write(key);
+        Write("\" \"");
+        Write(value);
+        Write("\"\n");
+    }
 
-}
\ No newline at end of file
+    void Brush(std::string_view content)
+    {
+        Write("{");
+        if (!std::memchr(content.data(), '/', content.size())) {
+            Write(content);
+        }
+        else {
+            // comments inside the brush go line by line
+            std::size_t begin = 0;
+            while (begin < content.size()) {
+                std::size_t end = content.find('\n', begin);
+                end = (end == std::string_view::npos) ? content.size() : end + 1;
+                std::string_view line = content.substr(begin, end - begin);
+                std::size_t first = line.find_first_not_of(" \t");
+                if (first == std::string_view::npos || line.substr(first, 2) != "//") {
+                    Write(line);
+                }
+                begin = end;
+            }
+        }
+        Write("}\n");
+    }
+
+    std::FILE* _fh;
+    std::string _buffer;
+    hash::Hasher _hasher;
+    bool _good = true;
+};
+
+bool WriteNormalizedMap(const MapFile& map, const MapDigests* digests, const MapLayerFilter* filter, const std::string& path,
+    std::uint64_t* hash)
+{
+    std::FILE* const fh = path::OpenFile(path, "wb");
+    if (!fh) {
+        return false;
+    }
+    std::setvbuf(fh, nullptr, _IONBF, 0);
+    NormalizedMapWriter out{ fh };
+
+    std::size_t world = map._entities.size();
+    std::vector<bool> merged(map._entities.size());
+    for (std::size_t i = 0; i < map._entities.size(); i++) {
+        if (world == map._entities.size() && map.GetField(map._entities[i], ATOM_CLASSNAME) == "worldspawn") {
+            world = i;
+        }
+        merged[i] = IsEditorGroup(map, map._entities[i]);
+    }
+
+    std::vector<const MapField*> fields;
+    auto write_entity = [&](std::size_t i) {
+        const auto& ent = map._entities[i];
+        // The fields are sorted by key, their views into the map text give back the file order.
+        fields.clear();
+        for (const auto& field : map.Fields(ent)) {
+            fields.push_back(&field);
+        }
+        std::sort(fields.begin(), fields.end(), [](const MapField* a, const MapField* b) {
+            return a->key.data() < b->key.data();
+        });
+        for (const auto* field : fields) {
+            if (IsEditorKey(field->key) || (digests && field->key == MAP_DIGEST_FIELD)) continue;
+            out.Field(field->key, field->value);
+        }
+        if (i != world || !filter || filter->world_brushes) {
+            for (const auto& content : ent.brush_content) {
+                out.Brush(content);
+            }
+        }
+    };
+
+    if (world < map._entities.size()) {
+        out.Write("{\n");
+        if (digests) {
+            out.Write("\"" + std::string{ MAP_DIGEST_FIELD } + "\" \"" + FormatDigests(*digests) + "\"\n", false);
+        }
+        write_entity(world);
+        for (std::size_t i = 0; i < map._entities.size(); i++) {
+            if (merged[i] && (!filter || filter->entities[i])) {
+                for (const auto& content : map._entities[i].brush_content) {
+                    out.Brush(content);
+                }
+            }
+        }
+        out.Write(CLOSE_ENTITY);
+    }
+    for (std::size_t i = 0; i < map._entities.size(); i++) {
+        if (i == world || merged[i] || (filter && !filter->entities[i])) continue;
+        out.Write("{\n");
+        write_entity(i);
+        out.Write(CLOSE_ENTITY);
+    }
+    out.Flush();
+
+    if (hash) {
+        *hash = out._hasher.Digest();
+    }
+    return (std::fclose(fh) == 0) && out._good;
+}
+
+bool ParseNumbers(std::string_view str, double* values, std::size_t count)
+{
+    const char* p = str.data();
+    const char* end = str.data() + str.size();
+    for (std::size_t i = 0; i < count; i++) {
+        while (p < end && *p == ' ') p++;
+        auto [next, ec] = std::from_chars(p, end, values[i]);
+        if (ec != std::errc{}) {
+            return false;
+        }
+        p = next;
+    }
+    return true;
+}
+
+bool GetEntityBounds(const MapFile& map, std::size_t entity, MapBounds& bounds)
+{
+    const MapGeometry& geo = map.GetGeometry();
+    bool found = false;
+    for (std::uint32_t b = geo.entity_brushes[entity]; b < geo.entity_brushes[entity + 1]; b++) {
+        MapBounds brush;
+        if (!GetBrushBounds(geo, b, brush)) continue;
+        if (!found) {
+            bounds = brush;
+            found = true;
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            bounds.mins[axis] = std::min(bounds.mins[axis], brush.mins[axis]);
+            bounds.maxs[axis] = std::max(bounds.maxs[axis], brush.maxs[axis]);
+        }
+    }
+    if (!found && geo.entity_brushes[entity] == geo.entity_brushes[entity + 1]) {
+        std::array<double, 3> origin;
+        found = ParseNumbers(map.GetField(map._entities[entity], ATOM_ORIGIN), origin.data(), 3);
+        bounds = MapBounds{ origin, origin };
+    }
+    return found;
+}
+
+MapRegion FilterMapRegion(const MapFile& map, const MapBounds& bounds, const MapLayerFilter* filter)
+{
+    const MapGeometry& geo = map.GetGeometry();
+
+    MapRegion region;
+    region.bounds = bounds;
+    region.brushes.resize(geo.NumBrushes());
+    for (std::size_t b = 0; b < geo.NumBrushes(); b++) {
+        MapBounds brush;
+        region.brushes[b] = GetBrushBounds(geo, b, brush) && bounds.Intersects(brush);
+    }
+
+    region.entities.reserve(map._entities.size());
+    for (std::size_t i = 0; i < map._entities.size(); i++) {
+        const auto& ent = map._entities[i];
+        std::string_view classname = map.GetField(ent, ATOM_CLASSNAME);
+        const std::uint32_t brush_begin = geo.entity_brushes[i];
+        const std::uint32_t brush_end = geo.entity_brushes[i + 1];
+        bool world = classname == "worldspawn";
+
+        bool kept = world || !filter || filter->entities[i];
+        bool world_brushes = world ? (!filter || filter->world_brushes) : kept;
+        bool any_brush = false;
+        for (std::uint32_t b = brush_begin; b < brush_end; b++) {
+            if (!world_brushes) {
+                region.brushes[b] = false;
+            }
+            any_brush = any_brush || region.brushes[b];
+        }
+
+        if (!world && kept) {
+            if (brush_begin != brush_end) {
+                kept = any_brush;
+            }
+            else {
+                std::array<double, 3> origin = {};
+                ParseNumbers(map.GetField(ent, ATOM_ORIGIN), origin.data(), 3);
+                kept = bounds.Contains(origin);
+            }
+        }
+        region.entities.push_back(kept);
+        region.has_player_start = region.has_player_start || (kept && classname == "info_player_start");
+    }
+    return region;
+}
+
+/// Where a field's value ends, after its closing quote. The entity's fields end with the last one.
+static std::size_t FieldEnd(const MapFile& map, const MapField& field)
+{
+    return field.value.data() + field.value.size() + 1 - map._text.data();
+}
+
+/// A box brush, its faces in the map's texture format.
+static void AppendBoxBrush(std::string& str, const std::array<double, 3>& mins, const std::array<double, 3>& maxs,
+    std::string_view texture, bool valve220)
+{
+    // Three points per face, wound so the normal points out of the box like qbsp expects, then the
+    // texture axes of the face for Valve 220.
+    struct Face
+    {
+        int axis;
+        bool max;
+        int p1_axis;
+        int p2_axis;
+        const char* valve_axes;
+    };
+    static const Face faces[6] = {
+        { 0, false, 1, 2, "[ 0 1 0 0 ] [ 0 0 -1 0 ]" },
+        { 0, true, 2, 1, "[ 0 1 0 0 ] [ 0 0 -1 0 ]" },
+        { 1, false, 2, 0, "[ 1 0 0 0 ] [ 0 0 -1 0 ]" },
+        { 1, true, 0, 2, "[ 1 0 0 0 ] [ 0 0 -1 0 ]" },
+        { 2, false, 0, 1, "[ 1 0 0 0 ] [ 0 -1 0 0 ]" },
+        { 2, true, 1, 0, "[ 1 0 0 0 ] [ 0 -1 0 0 ]" },
+    };
+
+    char buf[64];
+    auto append_point = [&](std::array<double, 3> point) {
+        std::snprintf(buf, sizeof(buf), "( %g %g %g ) ", point[0], point[1], point[2]);
+        str.append(buf);
+    };
+
+    str.append("{\n");
+    for (const Face& face : faces) {
+        std::array<double, 3> p0 = mins;
+        p0[face.axis] = face.max ? maxs[face.axis] : mins[face.axis];
+        std::array<double, 3> p1 = p0;
+        p1[face.p1_axis] += 64;
+        std::array<double, 3> p2 = p0;
+        p2[face.p2_axis] += 64;
+        append_point(p0);
+        append_point(p1);
+        append_point(p2);
+        str.append(texture);
+        if (valve220) {
+            str.append(" ").append(face.valve_axes).append(" 0 1 1\n");
+        }
+        else {
+            str.append(" 0 0 0 1 1\n");
+        }
+    }
+    str.append("}\n");
+}
+
+bool WriteRegionMap(const MapFile& map, const MapRegion& region, const std::string& path)
+{
+    static constexpr double SEAL_THICKNESS = 16;
+
+    const std::string_view text = map._text;
+    const MapGeometry& geo = map.GetGeometry();
+    bool valve220 = !geo.valve220.empty() && geo.valve220[0];
+
+    // The seal goes around the region on whole units, overlapping at the corners
+    std::array<double, 3> inner_mins, inner_maxs, outer_mins, outer_maxs;
+    for (int axis = 0; axis < 3; axis++) {
+        inner_mins[axis] = std::floor(region.bounds.mins[axis]);
+        inner_maxs[axis] = std::ceil(region.bounds.maxs[axis]);
+        outer_mins[axis] = inner_mins[axis] - SEAL_THICKNESS;
+        outer_maxs[axis] = inner_maxs[axis] + SEAL_THICKNESS;
+    }
+    std::string seal;
+    std::string_view texture = FindSealTexture(geo);
+    for (int axis = 0; axis < 3; axis++) {
+        std::array<double, 3> mins = outer_mins, maxs = outer_maxs;
+        maxs[axis] = inner_mins[axis];
+        AppendBoxBrush(seal, mins, maxs, texture.empty() ? "sky1" : texture, valve220);
+        mins = outer_mins;
+        maxs = outer_maxs;
+        mins[axis] = inner_maxs[axis];
+        AppendBoxBrush(seal, mins, maxs, texture.empty() ? "sky1" : texture, valve220);
+    }
+
+    std::string player_start;
+    if (!region.has_player_start) {
+        char origin[96];
+        std::snprintf(origin, sizeof(origin), "%g %g %g", std::floor((inner_mins[0] + inner_maxs[0]) / 2),
+            std::floor((inner_mins[1] + inner_maxs[1]) / 2), std::floor((inner_mins[2] + inner_maxs[2]) / 2));
+        player_start.append("{\n\"classname\" \"info_player_start\"\n\"origin\" \"").append(origin).append("\"\n}\n");
+    }
+
+    MapTextSpans spans{ text };
+    bool world_found = false;
+    spans.Add(0, map._entities.empty() ? text.size() : map._entities.front().offset);
+    for (std::size_t i = 0; i < map._entities.size(); i++) {
+        const auto& ent = map._entities[i];
+        std::size_t end = (i + 1 < map._entities.size()) ? map._entities[i + 1].offset : text.size();
+        if (!region.entities[i]) continue;
+
+        std::string_view classname = map.GetField(ent, ATOM_CLASSNAME);
+        bool world = !world_found && classname == "worldspawn";
+        world_found = world_found || world;
+        if (!world && !IsWorldClass(classname)) {
+            spans.Add(ent.offset, end);
+            continue;
+        }
+
+        // the fields come before the brushes
+        std::size_t fields_end = ent.offset + 1;
+        for (const auto& field : map.Fields(ent)) {
+            fields_end = std::max(fields_end, FieldEnd(map, field));
+        }
+        spans.Add(ent.offset, ent.brush_content.empty() ? fields_end : map._brush_offsets[ent.brush_begin]);
+        for (std::size_t k = 0; k < ent.brush_content.size(); k++) {
+            std::uint32_t b = ent.brush_begin + static_cast<std::uint32_t>(k);
+            if (!region.brushes[b]) continue;
+            if (k + 1 < ent.brush_content.size()) {
+                spans.Add(map._brush_offsets[b], map._brush_offsets[b + 1]);
+            }
+            else {
+                const auto& content = ent.brush_content[k];
+                spans.Add(map._brush_offsets[b], content.data() + content.size() + 1 - text.data());
+                spans.Push("\n");
+            }
+        }
+        if (world) {
+            spans.Push("\n");
+            spans.Push(seal);
+        }
+        spans.Push(CLOSE_ENTITY);
+    }
+    spans.Push(player_start);
+    return spans.Write(path);
+}
+
+struct MapLayerVisitor : MapVisitor
+{
+    void EntityBegin() override
+    {
+        _entities++;
+        _classname.clear();
+        _type.clear();
+        _name.clear();
+        _id.clear();
+    }
+
+    void Field(std::string_view key, std::string_view value) override
+    {
+        if (key == "classname") _classname = value;
+        else if (key == "_tb_type") _type = value;
+        else if (key == "_tb_name") _name = value;
+        else if (key == "_tb_id") _id = value;
+        else if (key == "_tb_mod" && _entities == 1) _mod = value;
+    }
+
+    void EntityEnd() override
+    {
+        if (_classname == "func_group" && _type == "_tb_layer") {
+            _layers.push_back(MapLayer{ _name, _id });
+        }
+    }
+
+    std::string _classname;
+    std::string _type;
+    std::string _name;
+    std::string _id;
+    std::string _mod;
+    std::size_t _entities = 0;
+    std::vector<MapLayer> _layers;
+};
+
+bool ReadMapLayers(const std::string& path, std::vector<MapLayer>& layers, std::string* tb_mod)
+{
+    MapLayerVisitor visitor;
+    if (!StreamMapFile(path, visitor)) {
+        return false;
+    }
+    layers = std::move(visitor._layers);
+    if (tb_mod) {
+        *tb_mod = visitor._mod.substr(0, visitor._mod.find(';'));
+    }
+    return true;
+}
+
+static bool Contains(std::string_view hay, std::string_view ned)
+{
+    return hay.find(ned) != std::string::npos;
+}
+
+/// FNV-1a, short enough to run at compile time.
+static constexpr std::uint64_t HashKey(std::string_view key, std::uint64_t seed)
+{
+    std::uint64_t h = 0xCBF29CE484222325ull ^ seed;
+    for (char c : key) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 0x100000001B3ull;
+    }
+    return h ^ (h >> 32);
+}
+
+struct KeyClassEntry
+{
+    std::string_view key;
+    MapKeyClass classes;
+};
+
+/// Hash table with one probe per lookup, built at compile time by trying seeds until no two keys
+/// share a slot. A duplicate key never stops colliding and fails the build.
+template<std::size_t SIZE>
+struct PerfectKeyTable
+{
+    static_assert((SIZE & (SIZE - 1)) == 0, "size must be a power of two");
+
+    template<std::size_t N>
+    constexpr explicit PerfectKeyTable(const KeyClassEntry (&entries)[N]) : _seed{ 0 }, _slots{}
+    {
+        static_assert(N * 4 <= SIZE, "too full to find a seed quickly");
+        for (;; _seed++) {
+            bool collision = false;
+            for (auto& slot : _slots) {
+                slot = KeyClassEntry{};
+            }
+            for (const auto& entry : entries) {
+                auto& slot = _slots[HashKey(entry.key, _seed) & (SIZE - 1)];
+                if (!slot.key.empty()) {
+                    collision = true;
+                    break;
+                }
+                slot = entry;
+            }
+            if (!collision) break;
+        }
+    }
+
+    constexpr MapKeyClass Find(std::string_view key) const
+    {
+        const auto& slot = _slots[HashKey(key, _seed) & (SIZE - 1)];
+        return slot.key == key ? slot.classes : 0;
+    }
+
+    std::uint64_t _seed;
+    KeyClassEntry _slots[SIZE];
+};
+
+static constexpr KeyClassEntry BUILTIN_KEY_CLASSES[] = {
+    // Ambient Occlusion options
+    { "_dirt", MAP_KEY_WORLDSPAWN_LIGHT | MAP_KEY_BRUSH_LIGHT },
+    { "_dirtmode", MAP_KEY_WORLDSPAWN_LIGHT }, { "_dirtscale", MAP_KEY_WORLDSPAWN_LIGHT }, { "_dirtgain", MAP_KEY_WORLDSPAWN_LIGHT },
+    { "_dirtdepth", MAP_KEY_WORLDSPAWN_LIGHT }, { "_dirtangle", MAP_KEY_WORLDSPAWN_LIGHT },
+
+    // Bounce lighting options
+    { "_bounce", MAP_KEY_WORLDSPAWN_LIGHT }, { "_bouncescale", MAP_KEY_WORLDSPAWN_LIGHT },
+    { "_bouncecolorscale", MAP_KEY_WORLDSPAWN_LIGHT }, { "_bouncestyled", MAP_KEY_WORLDSPAWN_LIGHT },
+
+    // Sun options
+    { "_sunlight", MAP_KEY_WORLDSPAWN_LIGHT }, { "_sunlight_color", MAP_KEY_WORLDSPAWN_LIGHT },
+    { "_sunlight_mangle", MAP_KEY_WORLDSPAWN_LIGHT }, { "_anglescale", MAP_KEY_WORLDSPAWN_LIGHT },
+    { "_sunlight_dirt", MAP_KEY_WORLDSPAWN_LIGHT }, { "_sunlight_penumbra", MAP_KEY_WORLDSPAWN_LIGHT },
+    { "_sunlight2", MAP_KEY_WORLDSPAWN_LIGHT }, { "_sunlight2_color", MAP_KEY_WORLDSPAWN_LIGHT },
+    { "_sunlight2_dirt", MAP_KEY_WORLDSPAWN_LIGHT },
+    { "_sunlight3", MAP_KEY_WORLDSPAWN_LIGHT }, { "_sunlight3_color", MAP_KEY_WORLDSPAWN_LIGHT },
+
+    // World lighting options, the minlight ones also apply to brush entities
+    { "_minlight", MAP_KEY_WORLDSPAWN_LIGHT | MAP_KEY_BRUSH_LIGHT },
+    { "_minlight_color", MAP_KEY_WORLDSPAWN_LIGHT | MAP_KEY_BRUSH_LIGHT },
+    { "_minlight_dirt", MAP_KEY_WORLDSPAWN_LIGHT }, { "_range", MAP_KEY_WORLDSPAWN_LIGHT },
+    { "_dist", MAP_KEY_WORLDSPAWN_LIGHT }, { "_gamma", MAP_KEY_WORLDSPAWN_LIGHT },
+    { "_spotlightautofalloff", MAP_KEY_WORLDSPAWN_LIGHT },
+
+    // Brush entity options
+    { "_lightignore", MAP_KEY_BRUSH_LIGHT }, { "_minlight_exclude", MAP_KEY_BRUSH_LIGHT },
+    { "_shadow", MAP_KEY_BRUSH_LIGHT }, { "_shadowself", MAP_KEY_BRUSH_LIGHT }, { "_shadowworldonly", MAP_KEY_BRUSH_LIGHT },
+    { "_phong", MAP_KEY_BRUSH_LIGHT }, { "_phong_angle", MAP_KEY_BRUSH_LIGHT }, { "_phong_angle_concave", MAP_KEY_BRUSH_LIGHT },
+
+    // TrenchBroom bookkeeping
+    { "_tb_group", MAP_KEY_IGNORED }, { "_tb_id", MAP_KEY_IGNORED },
+
+    // Added to the work copy, in case a map decompiled from a BSP still has it
+    { MAP_DIGEST_FIELD, MAP_KEY_IGNORED },
+};
+
+static constexpr PerfectKeyTable<256> g_builtin_keys{ BUILTIN_KEY_CLASSES };
+
+static_assert(g_builtin_keys.Find("_sunlight_mangle") == MAP_KEY_WORLDSPAWN_LIGHT, "perfect hash lookup");
+static_assert(g_builtin_keys.Find("_minlight") == (MAP_KEY_WORLDSPAWN_LIGHT | MAP_KEY_BRUSH_LIGHT), "perfect hash lookup");
+static_assert(g_builtin_keys.Find("classname") == 0, "perfect hash lookup");
+
+void MapKeyTable::Insert(std::string_view key, MapKeyClass classes)
+{
+    if ((_count + 1) * 2 > _slots.size()) {
+        // grow and rehash, keeping the table at most half full
+        std::vector<Slot> old = std::move(_slots);
+        _slots = std::vector<Slot>(old.empty() ? 16 : old.size() * 2);
+        _count = 0;
+        for (auto& slot : old) {
+            if (slot.classes) Insert(slot.key, slot.classes);
+        }
+    }
+
+    std::size_t mask = _slots.size() - 1;
+    for (std::size_t i = HashKey(key, 0) & mask;; i = (i + 1) & mask) {
+        Slot& slot = _slots[i];
+        if (!slot.classes) {
+            slot.key = std::string{ key };
+            slot.classes = classes;
+            _count++;
+            return;
+        }
+        if (slot.key == key) {
+            slot.classes |= classes;
+            return;
+        }
+    }
+}
+
+MapKeyClass MapKeyTable::Find(std::string_view key) const
+{
+    if (!_count) {
+        return 0;
+    }
+
+    std::size_t mask = _slots.size() - 1;
+    for (std::size_t i = HashKey(key, 0) & mask;; i = (i + 1) & mask) {
+        const Slot& slot = _slots[i];
+        if (!slot.classes) return 0;
+        if (slot.key == key) return slot.classes;
+    }
+}
+
+void MapDiffOptions::Build()
+{
+    _custom_keys = MapKeyTable{};
+    for (const auto& key : custom_worldspawn_light_fields) _custom_keys.Insert(key, MAP_KEY_WORLDSPAWN_LIGHT);
+    for (const auto& key : custom_brush_light_fields) _custom_keys.Insert(key, MAP_KEY_BRUSH_LIGHT);
+    for (const auto& key : custom_light_entities) _custom_keys.Insert(key, MAP_KEY_LIGHT_ENTITY);
+    for (const auto& key : ignore_field_diff) _custom_keys.Insert(key, MAP_KEY_IGNORED);
+
+    hash::Hasher hasher;
+    for (const auto* list : { &custom_worldspawn_light_fields, &custom_brush_light_fields, &custom_light_entities, &ignore_field_diff }) {
+        hasher.UpdateU64(list->size());
+        for (const auto& str : *list) {
+            hasher.UpdateString(str);
+        }
+    }
+    hasher.Update(&brush_epsilon, sizeof(brush_epsilon));
+    _hash = hasher.Digest();
+    _built = true;
+}
+
+MapKeyClass MapDiffOptions::Classify(std::string_view key) const
+{
+    return g_builtin_keys.Find(key) | _custom_keys.Find(key);
+}
+
+static const char* g_well_known_atoms[] = {
+    "classname", "origin", "_tb_type", "_tb_id", "_tb_name", "_tb_layer", "_tb_group", "_tb_mod"
+};
+
+static_assert(sizeof(g_well_known_atoms) / sizeof(const char*) == ATOM_WELL_KNOWN_COUNT, "well-known atom names out of sync");
+
+AtomTable::AtomTable()
+{
+    for (const char* name : g_well_known_atoms) {
+        Intern(name);
+    }
+}
+
+Atom AtomTable::Intern(std::string_view name)
+{
+    auto it = _atoms.find(name);
+    if (it != _atoms.end()) {
+        return it->second;
+    }
+
+    Atom atom = static_cast<Atom>(_names.size());
+    _atoms.emplace(name, atom);
+    _names.push_back(name);
+    return atom;
+}
+
+MapDialect DetectMapDialect(std::string_view text)
+{
+    std::size_t offs = text.find_first_not_of(" \t\r\n");
+    if (offs != std::string_view::npos && text.substr(offs, 2) == "//") {
+        return MAP_DIALECT_TRENCHBROOM;
+    }
+
+    // Valve 220 faces have their texture axes in brackets, look at the first face
+    std::size_t face = text.find('(');
+    if (face != std::string_view::npos) {
+        std::string_view line = text.substr(face, text.find('\n', face) - face);
+        if (line.find('[') != std::string_view::npos) {
+            return MAP_DIALECT_VALVE220;
+        }
+    }
+    return MAP_DIALECT_STANDARD;
+}
+
+/// Returns false if the map turned out to have comments the dialect doesn't handle.
+template<class Dialect>
+static bool ParseMap(std::string_view text, MapFile& map)
+{
+    if (text.size() >= PARALLEL_PARSE_MIN_SIZE && ParseParallel<Dialect>(text, map)) {
+        return true;
+    }
+
+    MapFileParser<Dialect> parser{ text };
+    if (parser._dialect_mismatch) {
+        return false;
+    }
+    map._entities = std::move(parser._entities);
+    map._fields = std::move(parser._fields);
+    map._brush_offsets = std::move(parser._brush_offsets);
+    map._atoms = std::move(parser._atoms);
+    return true;
+}
+
+MapFile::MapFile(const std::string& path)
+{
+    _mapping = std::make_unique<mapped_file::MappedFile>(path);
+    _text = _mapping->View();
+    _dialect = DetectMapDialect(_text);
+
+    if (_dialect == MAP_DIALECT_TRENCHBROOM || !ParseMap<IdDialect>(_text, *this)) {
+        ParseMap<TrenchBroomDialect>(_text, *this);
+    }
+
+    // look for layer entities
+    for (const auto& ent : _entities) {
+        if (GetField(ent, ATOM_CLASSNAME) == "func_group" && GetField(ent, ATOM_TB_TYPE) == "_tb_layer") {
+            _layers.push_back(MapLayer{std::string{GetField(ent, ATOM_TB_NAME)}, std::string{GetField(ent, ATOM_TB_ID)}});
+        }
+    }
+}
+
+const MapGeometry& MapFile::GetGeometry() const
+{
+    std::call_once(_geometry_once, [this]() {
+        auto geo = std::make_unique<MapGeometry>();
+        DecodeGeometry(*this, *geo);
+        _geometry = std::move(geo);
+    });
+    return *_geometry;
+}
+
+/// Counts the lines of every entity and brush in one pass, they are in file order:
+/// each entity, then its brushes.
+static void CountLines(const MapFile& map, std::vector<std::uint32_t>& entity_lines, std::vector<std::uint32_t>& brush_lines)
+{
+    entity_lines.resize(map._entities.size());
+    brush_lines.resize(map._brush_offsets.size());
+
+    std::size_t offs = 0;
+    std::uint32_t line = 1;
+    auto line_at = [&map, &offs, &line](std::size_t offset) {
+        line += static_cast<std::uint32_t>(CountNewlines(map._text.data() + offs, offset - offs));
+        offs = offset;
+        return line;
+    };
+
+    for (std::size_t i = 0; i < map._entities.size(); i++) {
+        const auto& ent = map._entities[i];
+        entity_lines[i] = line_at(ent.offset);
+        for (std::size_t b = 0; b < ent.brush_content.size(); b++) {
+            brush_lines[ent.brush_begin + b] = line_at(map._brush_offsets[ent.brush_begin + b]);
+        }
+    }
+}
+
+bool MapFile::FindEntityLocation(std::size_t entity, MapLocation& location) const
+{
+    if (entity >= _entities.size()) {
+        return false;
+    }
+
+    std::call_once(_lines_once, [this]() { CountLines(*this, _entity_lines, _brush_lines); });
+    location.offset = _entities[entity].offset;
+    location.line = _entity_lines[entity];
+    return true;
+}
+
+bool MapFile::FindBrushLocation(std::size_t entity, std::size_t brush, MapLocation& location) const
+{
+    if (entity >= _entities.size() || brush >= _entities[entity].brush_content.size()) {
+        return false;
+    }
+
+    std::call_once(_lines_once, [this]() { CountLines(*this, _entity_lines, _brush_lines); });
+    std::size_t index = _entities[entity].brush_begin + brush;
+    location.offset = _brush_offsets[index];
+    location.line = _brush_lines[index];
+    return true;
+}
+
+MapFieldRange MapFile::Fields(const MapEntity& ent) const
+{
+    const MapField* begin = _fields.data() + ent.field_begin;
+    return MapFieldRange{ begin, begin + ent.field_count };
+}
+
+const MapField* MapFile::FindField(const MapEntity& ent, Atom atom) const
+{
+    for (const auto& field : Fields(ent)) {
+        if (field.atom == atom) {
+            return &field;
+        }
+    }
+    return nullptr;
+}
+
+std::string_view MapFile::GetField(const MapEntity& ent, Atom atom) const
+{
+    const MapField* field = FindField(ent, atom);
+    return field ? field->value : std::string_view{};
+}
+
+std::string MapFile::GetTBMod() const {
+    if (!_entities.size()) {
+        return "";
+    }
+
+    const MapField* field = FindField(_entities[0], ATOM_TB_MOD);
+    if (!field) {
+        return "";
+    }
+
+    auto str = std::string(field->value);
+    auto pos = str.find(';');
+    if (pos != std::string::npos) {
+        return str.substr(0, pos);
+    }
+    else {
+        return str;
+    }
+}
+
+/// The content GetDiffFlags compares, reported piece by piece to fn(std::string_view), so it can be
+/// concatenated into a string or fed to a hash without building the string. Each entity is visited
+/// on its own, the map's content is the entities' content in file order.
+template<class Fn>
+static void VisitBrushContent(const MapEntity& ent, Fn&& fn)
+{
+    for (const auto& content : ent.brush_content) {
+        fn(content);
+    }
+}
+
+template<class Fn>
+static void VisitEntityContent(const MapFile& map, const MapEntity& ent, const MapDiffOptions& options, Fn&& fn)
+{
+    std::string_view classname = map.GetField(ent, ATOM_CLASSNAME);
+
+    if (!Contains(classname, "light")) {
+        for (const auto& field : map.Fields(ent)) {
+            if (!(options.Classify(field.key) & MAP_KEY_IGNORED)) {
+                fn(field.key);
+                fn(field.value);
+            }
+        }
+    }
+}
+
+template<class Fn>
+static void VisitLightContent(const MapFile& map, const MapEntity& ent, const MapDiffOptions& options, Fn&& fn)
+{
+    std::string_view classname = map.GetField(ent, ATOM_CLASSNAME);
+
+    if ((Contains(classname, "light") && (ent.brush_content.size() == 0))
+        || (options.Classify(classname) & MAP_KEY_LIGHT_ENTITY)) {
+        // Check light entity fields
+        for (const auto& field : map.Fields(ent)) {
+            if (!(options.Classify(field.key) & MAP_KEY_IGNORED)) {
+                fn(field.key);
+                fn(field.value);
+            }
+        }
+    }
+
+    if (ent.brush_content.size() > 0) {
+        // Check light-related fields for brush entities
+        for (const auto& field : map.Fields(ent)) {
+            if (options.Classify(field.key) & MAP_KEY_BRUSH_LIGHT) {
+                fn(field.key);
+                fn(field.value);
+            }
+        }
+    }
+
+    if (classname == "worldspawn") {
+        // Check light-related fields for the worldspawn entity
+        for (const auto& field : map.Fields(ent)) {
+            if (options.Classify(field.key) & MAP_KEY_WORLDSPAWN_LIGHT) {
+                fn(field.key);
+                fn(field.value);
+            }
+        }
+    }
+}
+
+std::string MapFile::GetBrushContent() const {
+    std::string buf;
+    for (const auto& ent : _entities) {
+        VisitBrushContent(ent, [&buf](std::string_view str) { buf.append(str); });
+    }
+    return buf;
+}
+
+std::string MapFile::GetEntityContent(const std::vector<std::string>& ignore_field_diff) const {
+    MapDiffOptions options;
+    options.ignore_field_diff = ignore_field_diff;
+    options.Build();
+
+    std::string buf;
+    for (const auto& ent : _entities) {
+        VisitEntityContent(*this, ent, options, [&buf](std::string_view str) { buf.append(str); });
+    }
+    return buf;
+}
+
+std::string MapFile::GetLightContent(
+    const std::vector<std::string>& custom_worldspawn_light_fields,
+    const std::vector<std::string>& custom_brush_light_fields,
+    const std::vector<std::string>& custom_light_entities,
+    const std::vector<std::string>& ignore_field_diff
+) const {
+    MapDiffOptions options;
+    options.custom_worldspawn_light_fields = custom_worldspawn_light_fields;
+    options.custom_brush_light_fields = custom_brush_light_fields;
+    options.custom_light_entities = custom_light_entities;
+    options.ignore_field_diff = ignore_field_diff;
+    options.Build();
+
+    std::string buf;
+    for (const auto& ent : _entities) {
+        VisitLightContent(*this, ent, options, [&buf](std::string_view str) { buf.append(str); });
+    }
+    return buf;
+}
+
+/// Digests of the map from the fingerprints of its entities, of the ones the filter keeps if given.
+static MapDigests CombineDigests(const MapFile& map, const MapFingerprints& fingerprints, std::uint64_t options_hash, const MapLayerFilter* filter)
+{
+    std::uint64_t world_brushes = 0, world_shapes = 0, entities = 0, lights = 0;
+    hash::Hasher brush_entities, shape_entities;
+    for (std::size_t i = 0; i < fingerprints.entities.size(); i++) {
+        const auto& fp = fingerprints.entities[i];
+        if (filter && !filter->entities[i]) {
+            continue;
+        }
+
+        if (!filter || filter->world_brushes || fp.classname != "worldspawn") {
+            world_brushes += fp.world_brushes;
+            world_shapes += fp.world_shapes;
+        }
+        if (!IsWorldClass(fp.classname) && !map._entities[i].brush_content.empty()) {
+            brush_entities.UpdateU64(fp.brushes);
+            shape_entities.UpdateU64(fp.shapes);
+        }
+        if (fp.fields) entities += hash::Mix(fp.fields);
+        if (fp.lights) lights += hash::Mix(fp.lights);
+    }
+    brush_entities.UpdateU64(world_brushes);
+    shape_entities.UpdateU64(world_shapes);
+
+    MapDigests digests;
+    digests.options_hash = options_hash;
+    if (filter) {
+        hash::Hasher selection;
+        selection.UpdateU64(options_hash);
+        selection.UpdateU64(filter->hash);
+        digests.options_hash = selection.Digest();
+    }
+    digests.brushes = brush_entities.Digest();
+    digests.shapes = shape_entities.Digest();
+    digests.entities = entities;
+    digests.lights = lights;
+    return digests;
+}
+
+std::shared_ptr<const MapFingerprints> MapFile::GetFingerprints(const MapDiffOptions& options, const MapFingerprints* previous) const
+{
+    if (!options._built) {
+        MapDiffOptions built = options;
+        built.Build();
+        return GetFingerprints(built, previous);
+    }
+    std::uint64_t options_hash = options._hash;
+
+    std::lock_guard<std::mutex> lock{ _fingerprints_mutex };
+    if (_fingerprints && _fingerprints->digests.options_hash == options_hash) {
+        return _fingerprints;
+    }
+
+    // Pieces are hashed with their length, so bytes moving from a key to its value still count as a change.
+    // Editors reorder entities and brushes on save, so the map's digests combine the entity and brush
+    // digests with a sum, which doesn't depend on their order. The one order that matters is that of
+    // brush entities, their models are numbered in file order.
+    auto fingerprints = std::make_shared<MapFingerprints>();
+    fingerprints->digests.options_hash = options_hash;
+    fingerprints->entities.reserve(_entities.size());
+
+    static const std::unordered_map<std::uint64_t, BrushHashes> NO_BRUSHES;
+    const auto& previous_brushes = (previous && previous->digests.options_hash == options_hash) ? previous->brush_hashes : NO_BRUSHES;
+    fingerprints->brush_hashes.reserve(_brush_offsets.size());
+    const double shape_epsilon = std::max(options.brush_epsilon, 0.0);
+
+    for (const auto& ent : _entities) {
+        EntityFingerprint fp;
+        fp.classname = GetField(ent, ATOM_CLASSNAME);
+        fp.tb_id = GetField(ent, ATOM_TB_ID);
+
+        // Brushes of TrenchBroom layers and groups end up in the world, they can move between them
+        // without changing the BSP as long as they stay in the same layer.
+        bool world = IsWorldClass(fp.classname);
+        std::string_view layer = GetField(ent, ATOM_TB_TYPE) == "_tb_layer" ? fp.tb_id : GetField(ent, ATOM_TB_LAYER);
+        std::uint64_t layer_hash = layer.empty() ? 0 : hash::Hash(layer);
+
+        VisitBrushContent(ent, [&](std::string_view str) {
+            std::uint64_t text = hash::Hash(str);
+            BrushHashes hashes;
+            auto it = previous_brushes.find(text);
+            if (it != previous_brushes.end()) {
+                hashes = it->second;
+            }
+            else {
+                hashes.canonical = (options.brush_epsilon >= 0.0) ? HashBrushCanonical(str, options.brush_epsilon) : text;
+                hashes.shape = HashBrushShape(str, shape_epsilon);
+            }
+            fingerprints->brush_hashes.emplace(text, hashes);
+
+            fp.brushes += hash::Mix(hashes.canonical);
+            fp.shapes += hash::Mix(hashes.shape);
+            if (world) {
+                fp.world_brushes += hash::Mix(hashes.canonical ^ layer_hash);
+                fp.world_shapes += hash::Mix(hashes.shape ^ layer_hash);
+            }
+        });
+
+        hash::Hasher ent_fields, ent_lights;
+        VisitEntityContent(*this, ent, options, [&ent_fields](std::string_view str) { ent_fields.UpdateString(str); });
+        VisitLightContent(*this, ent, options, [&ent_lights](std::string_view str) { ent_lights.UpdateString(str); });
+        fp.fields = ent_fields._total ? ent_fields.Digest() : 0;
+        fp.lights = ent_lights._total ? ent_lights.Digest() : 0;
+        fingerprints->entities.push_back(fp);
+    }
+
+    fingerprints->digests = CombineDigests(*this, *fingerprints, options_hash, nullptr);
+    _fingerprints = std::move(fingerprints);
+    return _fingerprints;
+}
+
+MapDigests MapFile::GetDigests(const MapDiffOptions& options, const MapLayerFilter* filter) const
+{
+    auto fingerprints = GetFingerprints(options);
+    return filter ? CombineDigests(*this, *fingerprints, fingerprints->digests.options_hash, filter) : fingerprints->digests;
+}
+
+std::string FormatDigests(const MapDigests& digests)
+{
+    char str[96];
+    std::snprintf(str, sizeof(str), "%016llx %016llx %016llx %016llx %016llx",
+        (unsigned long long)digests.options_hash, (unsigned long long)digests.brushes,
+        (unsigned long long)digests.entities, (unsigned long long)digests.lights, (unsigned long long)digests.shapes);
+    return str;
+}
+
+bool ParseDigests(std::string_view str, MapDigests& digests)
+{
+    MapDigests result;
+    std::uint64_t* values[] = { &result.options_hash, &result.brushes, &result.entities, &result.lights, &result.shapes };
+
+    const char* p = str.data();
+    const char* end = str.data() + str.size();
+    for (std::uint64_t* value : values) {
+        if (value != values[0]) {
+            if (p == end || *p != ' ') return false;
+            p++;
+        }
+        auto [next, ec] = std::from_chars(p, end, *value, 16);
+        if (ec != std::errc{} || next - p != 16) {
+            return false;
+        }
+        p = next;
+    }
+    if (p != end) {
+        return false;
+    }
+
+    digests = result;
+    return true;
+}
+
+MapDiffFlags GetDiffFlags(const MapDigests& a, const MapDigests& b)
+{
+    if (a.options_hash != b.options_hash) {
+        return MAP_DIFF_BRUSHES | MAP_DIFF_ENTS | MAP_DIFF_LIGHTS;
+    }
+
+    MapDiffFlags flags = MAP_DIFF_NONE;
+    if (a.brushes != b.brushes) flags |= (a.shapes == b.shapes) ? MAP_DIFF_TEXTURES : MAP_DIFF_BRUSHES;
+    if (a.entities != b.entities) flags |= MAP_DIFF_ENTS;
+    if (a.lights != b.lights) flags |= MAP_DIFF_LIGHTS;
+    return flags;
+}
+
+MapDiffFlags GetDiffFlags(const MapFile& a, const MapFile& b, const MapDiffOptions& options)
+{
+    auto fps_a = a.GetFingerprints(options);
+    return GetDiffFlags(fps_a->digests, b.GetFingerprints(options, fps_a.get())->digests);
+}
+
+/// Keys whose value was added, removed or changed between two versions of an entity. Both field
+/// ranges are sorted by key, so one merge pass finds them.
+static void GetChangedFields(const MapFile& a, const MapEntity& ent_a, const MapFile& b, const MapEntity& ent_b,
+    const MapDiffOptions& options, std::vector<std::string>& changed)
+{
+    MapFieldRange fields_a = a.Fields(ent_a);
+    MapFieldRange fields_b = b.Fields(ent_b);
+    const MapField* it_a = fields_a.begin();
+    const MapField* it_b = fields_b.begin();
+
+    while (it_a != fields_a.end() || it_b != fields_b.end()) {
+        std::string_view key;
+        if (it_b == fields_b.end() || (it_a != fields_a.end() && it_a->key < it_b->key)) {
+            key = (it_a++)->key;
+        }
+        else if (it_a == fields_a.end() || it_b->key < it_a->key) {
+            key = (it_b++)->key;
+        }
+        else {
+            bool same = it_a->value == it_b->value;
+            key = it_a->key;
+            it_a++;
+            it_b++;
+            if (same) continue;
+        }
+
+        if (!(options.Classify(key) & MAP_KEY_IGNORED)) {
+            changed.emplace_back(key);
+        }
+    }
+}
+
+static std::uint64_t GetContentHash(const EntityFingerprint& fp)
+{
+    hash::Hasher hasher;
+    hasher.UpdateU64(fp.brushes);
+    hasher.UpdateU64(fp.fields);
+    hasher.UpdateU64(fp.lights);
+    return hasher.Digest();
+}
+
+MapChangeSet GetChangeSet(const MapFile& a, const MapFile& b, const MapDiffOptions& options)
+{
+    if (!options._built) {
+        MapDiffOptions built = options;
+        built.Build();
+        return GetChangeSet(a, b, built);
+    }
+
+    auto fps_a = a.GetFingerprints(options);
+    auto fps_b = b.GetFingerprints(options, fps_a.get());
+    const auto& ents_a = fps_a->entities;
+    const auto& ents_b = fps_b->entities;
+
+    MapChangeSet changes;
+    changes.flags = GetDiffFlags(fps_a->digests, fps_b->digests);
+    if (changes.flags == MAP_DIFF_NONE) {
+        return changes;
+    }
+
+    const std::uint32_t NO_MATCH = static_cast<std::uint32_t>(ents_a.size());
+    std::vector<std::uint32_t> match_of_b(ents_b.size(), NO_MATCH);
+    std::vector<bool> matched(ents_a.size(), false);
+
+    // Layers and groups by their _tb_id, other entities that didn't change by their content,
+    // wherever they moved in the file.
+    std::unordered_map<std::string_view, std::uint32_t> by_id;
+    std::unordered_multimap<std::uint64_t, std::uint32_t> by_content;
+    for (std::uint32_t i = 0; i < ents_a.size(); i++) {
+        if (!ents_a[i].tb_id.empty()) {
+            by_id.emplace(ents_a[i].tb_id, i);
+        }
+        else {
+            by_content.emplace(GetContentHash(ents_a[i]), i);
+        }
+    }
+
+    for (std::uint32_t i = 0; i < ents_b.size(); i++) {
+        const EntityFingerprint& fp_b = ents_b[i];
+        if (!fp_b.tb_id.empty()) {
+            auto it = by_id.find(fp_b.tb_id);
+            if (it != by_id.end() && !matched[it->second]) match_of_b[i] = it->second;
+        }
+        else {
+            auto range = by_content.equal_range(GetContentHash(fp_b));
+            for (auto it = range.first; it != range.second; ++it) {
+                if (!matched[it->second] && ents_a[it->second].classname == fp_b.classname) {
+                    match_of_b[i] = it->second;
+                    break;
+                }
+            }
+        }
+        if (match_of_b[i] != NO_MATCH) {
+            matched[match_of_b[i]] = true;
+        }
+    }
+
+    // The rest are paired up in file order per classname, so an edited light is matched with the
+    // light it used to be.
+    std::unordered_map<std::string_view, std::vector<std::uint32_t>> unmatched_by_classname;
+    for (std::uint32_t i = 0; i < ents_a.size(); i++) {
+        if (!matched[i] && ents_a[i].tb_id.empty()) {
+            unmatched_by_classname[ents_a[i].classname].push_back(i);
+        }
+    }
+    std::unordered_map<std::string_view, std::size_t> ordinals;
+    for (std::uint32_t i = 0; i < ents_b.size(); i++) {
+        if (match_of_b[i] != NO_MATCH || !ents_b[i].tb_id.empty()) continue;
+        auto it = unmatched_by_classname.find(ents_b[i].classname);
+        std::size_t ordinal = ordinals[ents_b[i].classname]++;
+        if (it != unmatched_by_classname.end() && ordinal < it->second.size()) {
+            match_of_b[i] = it->second[ordinal];
+            matched[match_of_b[i]] = true;
+        }
+    }
+
+    for (std::uint32_t i = 0; i < ents_b.size(); i++) {
+        std::uint32_t match = match_of_b[i];
+        if (match == NO_MATCH) {
+            changes.added.push_back(i);
+            continue;
+        }
+
+        const EntityFingerprint& fp_a = ents_a[match];
+        const EntityFingerprint& fp_b = ents_b[i];
+        MapEntityChange change;
+        change.old_index = match;
+        change.new_index = i;
+        if (fp_a.brushes != fp_b.brushes) change.flags |= (fp_a.shapes == fp_b.shapes) ? MAP_DIFF_TEXTURES : MAP_DIFF_BRUSHES;
+        if (fp_a.fields != fp_b.fields) change.flags |= MAP_DIFF_ENTS;
+        if (fp_a.lights != fp_b.lights) change.flags |= MAP_DIFF_LIGHTS;
+        if (change.flags == MAP_DIFF_NONE) {
+            continue;
+        }
+
+        if (change.flags & (MAP_DIFF_ENTS | MAP_DIFF_LIGHTS)) {
+            GetChangedFields(a, a._entities[match], b, b._entities[i], options, change.fields);
+        }
+        changes.modified.push_back(std::move(change));
+    }
+
+    for (std::uint32_t i = 0; i < ents_a.size(); i++) {
+        if (!matched[i]) {
+            changes.removed.push_back(i);
+        }
+    }
+
+    return changes;
+}
+
+}
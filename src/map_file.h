@@ -1,9 +1,15 @@
 #pragma once
 
+#include <cstdint>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
-#include <map>
 #include <string_view>
+#include <unordered_map>
+#include "map_geometry.h"
+#include "mapped_file.h"
 
 namespace map_file {
 
@@ -13,11 +19,228 @@ static constexpr MapDiffFlags MAP_DIFF_NONE = 0x0;
 static constexpr MapDiffFlags MAP_DIFF_ENTS = 0x1;
 static constexpr MapDiffFlags MAP_DIFF_LIGHTS = 0x2;
 static constexpr MapDiffFlags MAP_DIFF_BRUSHES = 0x4;
+// Brushes changed, but only their textures or texture alignment, see HashBrushShape. Set instead of
+// MAP_DIFF_BRUSHES.
+static constexpr MapDiffFlags MAP_DIFF_TEXTURES = 0x8;
+
+/// Flavours of the .map format, told apart by the file header and the first brush.
+enum MapDialect
+{
+    // id's original format, no comments.
+    MAP_DIALECT_STANDARD,
+    // Valve 220 texture axes, no comments.
+    MAP_DIALECT_VALVE220,
+    // Written by TrenchBroom: a "// Game:" comment header, comments before every entity and
+    // brush and _tb_* metadata fields, with either texture format.
+    MAP_DIALECT_TRENCHBROOM,
+};
+
+MapDialect DetectMapDialect(std::string_view text);
+
+typedef std::uint32_t Atom;
+
+/// Keys interned up front by every AtomTable, so their atoms are the same in every map.
+enum WellKnownAtom : Atom
+{
+    ATOM_CLASSNAME,
+    ATOM_ORIGIN,
+    ATOM_TB_TYPE,
+    ATOM_TB_ID,
+    ATOM_TB_NAME,
+    ATOM_TB_LAYER,
+    ATOM_TB_GROUP,
+    ATOM_TB_MOD,
+    ATOM_WELL_KNOWN_COUNT,
+};
+
+/// Maps field keys to small integers, so lookups of common fields compare integers instead of strings.
+struct AtomTable
+{
+    AtomTable();
+
+    Atom Intern(std::string_view name);
+
+    std::string_view Name(Atom atom) const { return _names[atom]; }
+
+    std::unordered_map<std::string_view, Atom> _atoms;
+    std::vector<std::string_view> _names;
+};
+
+struct MapField
+{
+    Atom atom;
+    std::string_view key;
+    std::string_view value;
+};
+
+struct MapFieldRange
+{
+    const MapField* begin() const { return _begin; }
+    const MapField* end() const { return _end; }
+    std::size_t size() const { return _end - _begin; }
+
+    const MapField* _begin;
+    const MapField* _end;
+};
 
 struct MapEntity
 {
-    std::map<std::string_view, std::string_view> fields;
+    // Range in MapFile::_fields, sorted by key with duplicate keys resolved to the last value.
+    std::uint32_t field_begin = 0;
+    std::uint32_t field_count = 0;
     std::vector<std::string_view> brush_content;
+
+    // Offset of the entity's opening brace in the map text.
+    std::size_t offset = 0;
+    // Index of the entity's first brush in MapFile::_brush_offsets.
+    std::uint32_t brush_begin = 0;
+};
+
+/// Where an entity or brush starts in the map text, at its opening brace.
+struct MapLocation
+{
+    std::size_t offset = 0;
+    // 1-based, like editors count them.
+    std::uint32_t line = 0;
+};
+
+static constexpr double DEFAULT_BRUSH_EPSILON = 0.001;
+
+/// What the diff does with a field key or classname, as bit flags.
+typedef std::uint8_t MapKeyClass;
+
+static constexpr MapKeyClass MAP_KEY_WORLDSPAWN_LIGHT = 0x1;
+static constexpr MapKeyClass MAP_KEY_BRUSH_LIGHT = 0x2;
+static constexpr MapKeyClass MAP_KEY_IGNORED = 0x4;
+// A classname, entities of that class are lights.
+static constexpr MapKeyClass MAP_KEY_LIGHT_ENTITY = 0x8;
+
+/// Open-addressing hash table from key to MapKeyClass, for the keys a config adds.
+struct MapKeyTable
+{
+    void Insert(std::string_view key, MapKeyClass classes);
+
+    MapKeyClass Find(std::string_view key) const;
+
+    struct Slot
+    {
+        std::string key;
+        MapKeyClass classes = 0;
+    };
+
+    std::vector<Slot> _slots;
+    std::size_t _count = 0;
+};
+
+/// What the diff compares, set per config.
+struct MapDiffOptions
+{
+    /// Merges the lists into the key table and hashes the options. Call it after changing them,
+    /// configs do it once when they're loaded. Diffing with options that weren't built builds a copy
+    /// on every call.
+    void Build();
+
+    /// Built-in and custom classes of a field key or classname.
+    MapKeyClass Classify(std::string_view key) const;
+
+    std::vector<std::string> custom_worldspawn_light_fields;
+    std::vector<std::string> custom_brush_light_fields;
+    std::vector<std::string> custom_light_entities;
+    std::vector<std::string> ignore_field_diff;
+    // Brush numbers are compared on a grid of this size, see HashBrushCanonical. Negative compares
+    // the brush text byte for byte.
+    double brush_epsilon = DEFAULT_BRUSH_EPSILON;
+
+    // Set by Build().
+    MapKeyTable _custom_keys;
+    std::uint64_t _hash = 0;
+    bool _built = false;
+};
+
+/// Digests of what GetDiffFlags compares, one per diff category. The entity and light digests
+/// depend on the diff options they were made with. None of them depend on the order of entities
+/// and brushes, except for the order of brush entities.
+struct MapDigests
+{
+    std::uint64_t options_hash = 0;
+    std::uint64_t brushes = 0;
+    std::uint64_t entities = 0;
+    std::uint64_t lights = 0;
+    // Like brushes, but blind to textures and texture alignment.
+    std::uint64_t shapes = 0;
+};
+
+/// Digests of one entity, per diff category. The brush digest doesn't depend on the order of the
+/// brushes, each digest is 0 if the entity has nothing of its category.
+struct EntityFingerprint
+{
+    std::string_view classname;
+    std::string_view tb_id;
+    std::uint64_t brushes = 0;
+    std::uint64_t fields = 0;
+    std::uint64_t lights = 0;
+    std::uint64_t shapes = 0;
+    // What the brushes add to the world brushes of the map, 0 if they're not merged into the world.
+    // They're hashed with their layer, moving a brush to another layer is a change.
+    std::uint64_t world_brushes = 0;
+    std::uint64_t world_shapes = 0;
+};
+
+struct BrushHashes
+{
+    std::uint64_t canonical = 0;
+    std::uint64_t shape = 0;
+};
+
+struct MapFingerprints
+{
+    MapDigests digests;
+    // One per entity, in file order.
+    std::vector<EntityFingerprint> entities;
+    // Canonical and shape hashes of every brush by the hash of its text, so the next version of the
+    // map only has to hash the brushes that were edited again.
+    std::unordered_map<std::uint64_t, BrushHashes> brush_hashes;
+};
+
+/// Worldspawn field with the digests of the map a BSP was built from. The compile writes it into the
+/// entity lump of the output BSP once every step succeeded, see bsp_file::WriteMapDigests.
+static constexpr std::string_view MAP_DIGEST_FIELD = "_q1c_digest";
+
+std::string FormatDigests(const MapDigests& digests);
+
+/// Returns false if the string isn't five hex digests, as FormatDigests writes them.
+bool ParseDigests(std::string_view str, MapDigests& digests);
+
+struct MapEntityChange
+{
+    std::uint32_t old_index = 0;
+    std::uint32_t new_index = 0;
+    MapDiffFlags flags = MAP_DIFF_NONE;
+    // Keys added, removed or changed, sorted. Brush changes don't list any.
+    std::vector<std::string> fields;
+};
+
+/// What changed between two versions of a map. Entity indices are into MapFile::_entities.
+struct MapChangeSet
+{
+    // Same as GetDiffFlags. Entities that only moved aren't listed, but reordered brush entities
+    // still count as a brush change here, their models are numbered in file order.
+    MapDiffFlags flags = MAP_DIFF_NONE;
+    std::vector<std::uint32_t> added;
+    std::vector<std::uint32_t> removed;
+    std::vector<MapEntityChange> modified;
+};
+
+/// Which entities of a map to compile, by TrenchBroom layer, see FilterMapLayers.
+struct MapLayerFilter
+{
+    // One per entity of the map, the worldspawn is always kept.
+    std::vector<bool> entities;
+    // The worldspawn brushes are the default layer.
+    bool world_brushes = true;
+    // Hash of the selected layer ids and the default layer, digests of different selections can't
+    // be compared.
+    std::uint64_t hash = 0;
 };
 
 struct MapLayer
@@ -43,18 +266,141 @@ struct MapFile
         const std::vector<std::string>& ignore_field_diff
     ) const;
 
+    /// Hashes the brush, entity and light content of the map and of each entity on first use and
+    /// caches the result until it's asked for with other diff options, so a map is walked once
+    /// however often it's diffed.
+    /// Pass the fingerprints of the previous version of the map to reuse its brush hashes.
+    std::shared_ptr<const MapFingerprints> GetFingerprints(const MapDiffOptions& options, const MapFingerprints* previous = nullptr) const;
+
+    /// With a filter, the digests only cover what it keeps of the map, so changes elsewhere don't count.
+    MapDigests GetDigests(const MapDiffOptions& options, const MapLayerFilter* filter = nullptr) const;
+
+    MapFieldRange Fields(const MapEntity& ent) const;
+
+    const MapField* FindField(const MapEntity& ent, Atom atom) const;
+
+    /// Returns an empty view if the entity doesn't have the field.
+    std::string_view GetField(const MapEntity& ent, Atom atom) const;
+
+    /// Returns false if there's no such entity.
+    bool FindEntityLocation(std::size_t entity, MapLocation& location) const;
+
+    /// Brushes are numbered per entity, like the compile tools report them.
+    /// Returns false if there's no such brush.
+    bool FindBrushLocation(std::size_t entity, std::size_t brush, MapLocation& location) const;
+
+    /// Decodes the brush faces on first use, only features that need geometry pay for it.
+    const MapGeometry& GetGeometry() const;
+
     bool Good() const { return !_text.empty(); }
 
-    std::string _text;
+    // Every string_view in the map points into this buffer.
+    std::unique_ptr<mapped_file::MappedFile> _mapping;
+    std::string_view _text;
+    MapDialect _dialect = MAP_DIALECT_STANDARD;
     std::vector<MapEntity> _entities;
+    std::vector<MapField> _fields;
+    // Opening brace of every brush of the map, in file order.
+    std::vector<std::size_t> _brush_offsets;
     std::vector<MapLayer> _layers;
+    AtomTable _atoms;
+
+    mutable std::once_flag _geometry_once;
+    mutable std::unique_ptr<MapGeometry> _geometry;
+
+    mutable std::mutex _fingerprints_mutex;
+    mutable std::shared_ptr<const MapFingerprints> _fingerprints;
+
+    // Line numbers of the entities and brushes, counted on the first location lookup. Counting
+    // them while parsing would slow down every parse for the few that need them.
+    mutable std::once_flag _lines_once;
+    mutable std::vector<std::uint32_t> _entity_lines;
+    mutable std::vector<std::uint32_t> _brush_lines;
 };
 
-MapDiffFlags GetDiffFlags(const MapFile& a, const MapFile& b,
-    const std::vector<std::string>& custom_worldspawn_light_fields,
-    const std::vector<std::string>& custom_brush_light_fields,
-    const std::vector<std::string>& custom_light_entities,
-    const std::vector<std::string>& ignore_field_diff
-);
+/// Receives the contents of a map as StreamMapFile reads it. Fields are reported in file order,
+/// without the sorting and de-duplication MapFile does, and the views are only valid during the call.
+struct MapVisitor
+{
+    virtual ~MapVisitor() = default;
+
+    virtual void EntityBegin() {}
+
+    virtual void Field(std::string_view, std::string_view) {}
+
+    virtual void Brush(std::string_view) {}
+
+    virtual void EntityEnd() {}
+};
+
+static constexpr std::size_t MAP_STREAM_CHUNK_SIZE = 1024 * 1024;
+
+/// Parses the map in fixed-size chunks, keeping only the current chunk and the field or brush in
+/// progress in memory. Returns false if the file couldn't be opened.
+bool StreamMapFile(const std::string& path, MapVisitor& visitor, std::size_t chunk_size = MAP_STREAM_CHUNK_SIZE);
+
+/// Parses map text that's already in memory, like the entity lump of a BSP.
+void VisitMapText(std::string_view text, MapVisitor& visitor);
+
+/// Keeps the entities of the layers with the given names, and the ones outside of any layer if
+/// default_layer is set. Entities in groups are in the layer of their outermost group.
+MapLayerFilter FilterMapLayers(const MapFile& map, const std::vector<std::string>& layer_names, bool default_layer);
+
+/// Writes the copy of the map the tools compile, with the digests in its worldspawn if given, on the line
+/// of its opening brace so the tools report the same line numbers as for the source map. With a filter only
+/// the entities it keeps are written. The pieces are written straight from the map text.
+bool WriteWorkMap(const MapFile& map, const MapDigests* digests, const MapLayerFilter* filter, const std::string& path);
+
+/// Fields only the editor reads, TrenchBroom's _tb_* bookkeeping.
+bool IsEditorKey(std::string_view key);
+
+/// Writes the work map like WriteWorkMap, without what only the editor reads: comments, _tb_* fields
+/// and the func_groups of TrenchBroom layers and groups, whose brushes go into the worldspawn as qbsp
+/// would put them anyway. The map is written through a fixed-size buffer. The hash of the bytes
+/// written, all but the digests, goes to hash if given: saves that only change editor state give the
+/// same hash.
+bool WriteNormalizedMap(const MapFile& map, const MapDigests* digests, const MapLayerFilter* filter, const std::string& path,
+    std::uint64_t* hash = nullptr);
+
+/// What a region compile keeps of a map, see FilterMapRegion.
+struct MapRegion
+{
+    MapBounds bounds;
+    // One per entity of the map. Brush entities are kept whole, the worldspawn always.
+    std::vector<bool> entities;
+    // One per brush of the map, for the worldspawn and func_groups only. qbsp merges those into the
+    // world, so they're cut down brush by brush.
+    std::vector<bool> brushes;
+    bool has_player_start = false;
+};
+
+/// Reads count numbers separated by spaces, like the value of an origin field.
+bool ParseNumbers(std::string_view str, double* values, std::size_t count);
+
+/// Bounds of an entity's brushes, or its origin for a point entity. Returns false if it has neither.
+bool GetEntityBounds(const MapFile& map, std::size_t entity, MapBounds& bounds);
+
+/// Keeps the brushes that touch the box and the point entities in it, of what the layer filter
+/// keeps if given. Brush entities are kept if any of their brushes touches the box.
+MapRegion FilterMapRegion(const MapFile& map, const MapBounds& bounds, const MapLayerFilter* filter);
+
+/// Writes the region of the map for the tools, sealed in a hollow box of the map's sky or most used
+/// texture so it doesn't leak, and with a player start in its middle if it has none.
+bool WriteRegionMap(const MapFile& map, const MapRegion& region, const std::string& path);
+
+/// Finds the TrenchBroom layers of a map without loading the whole file, and its mod as MapFile::GetTBMod
+/// returns it if tb_mod is given.
+bool ReadMapLayers(const std::string& path, std::vector<MapLayer>& layers, std::string* tb_mod = nullptr);
+
+/// Digests made with different diff options can't be compared, everything counts as changed then.
+MapDiffFlags GetDiffFlags(const MapDigests& a, const MapDigests& b);
+
+MapDiffFlags GetDiffFlags(const MapFile& a, const MapFile& b, const MapDiffOptions& options);
+
+/// Matches the entities of both maps and compares their fingerprints. TrenchBroom layers and groups
+/// are matched by _tb_id, unchanged entities by their content wherever they moved, and what's left by
+/// their order among the entities of the same classname. Only changed entities are reported, and
+/// field keys are only compared for entities whose fields changed.
+MapChangeSet GetChangeSet(const MapFile& a, const MapFile& b, const MapDiffOptions& options);
 
-}
\ No newline at end of file
+}
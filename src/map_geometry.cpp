@@ -0,0 +1,562 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include "map_file.h"
+#include "map_geometry.h"
+
+namespace map_file {
+
+static const double POW10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+
+struct FaceTokenizer
+{
+    explicit FaceTokenizer(std::string_view text) : _p{ text.data() }, _end{ text.data() + text.size() } {}
+
+    bool AtEnd() const { return _p >= _end; }
+
+    char Ch() const { return _p < _end ? *_p : 0; }
+
+    void SkipSpace()
+    {
+        while (_p < _end && (*_p == ' ' || *_p == '\t' || *_p == '\r')) _p++;
+    }
+
+    void SkipLine()
+    {
+        while (_p < _end && *_p != '\n') _p++;
+        if (_p < _end) _p++;
+    }
+
+    void SkipBlankLines()
+    {
+        while (_p < _end && (*_p == ' ' || *_p == '\t' || *_p == '\r' || *_p == '\n')) _p++;
+    }
+
+    bool Expect(char c)
+    {
+        SkipSpace();
+        if (Ch() != c) return false;
+        _p++;
+        return true;
+    }
+
+    bool Float(float& f)
+    {
+        double d;
+        if (!Number(d)) return false;
+        f = static_cast<float>(d);
+        return true;
+    }
+
+    bool Number(double& d)
+    {
+        SkipSpace();
+        if (Ch() == '+') _p++;
+
+        // Fast path for plain decimals, exact as long as the mantissa and the power of ten fit in a double.
+
+        const char* p = _p;
+        bool negative = (p < _end && *p == '-');
+        if (negative) p++;
+
+        std::uint64_t mantissa = 0;
+        int digits = 0;
+        int frac_digits = 0;
+        for (; p < _end && *p >= '0' && *p <= '9'; p++, digits++) {
+            mantissa = mantissa * 10 + (*p - '0');
+        }
+        if (p < _end && *p == '.') {
+            for (p++; p < _end && *p >= '0' && *p <= '9'; p++, digits++, frac_digits++) {
+                mantissa = mantissa * 10 + (*p - '0');
+            }
+        }
+
+        bool exponent = (p < _end && (*p == 'e' || *p == 'E'));
+        if (digits > 0 && digits <= 15 && !exponent) {
+            d = static_cast<double>(mantissa) / POW10[frac_digits];
+            if (negative) d = -d;
+            _p = p;
+            return true;
+        }
+
+        auto result = std::from_chars(_p, _end, d);
+        if (result.ec != std::errc{}) return false;
+        _p = result.ptr;
+        return true;
+    }
+
+    bool Word(std::string_view& word)
+    {
+        SkipSpace();
+        const char* begin = _p;
+        while (_p < _end && *_p != ' ' && *_p != '\t' && *_p != '\r' && *_p != '\n') _p++;
+        word = std::string_view(begin, _p - begin);
+        return !word.empty();
+    }
+
+    const char* _p;
+    const char* _end;
+};
+
+struct GeometryDecoder
+{
+    explicit GeometryDecoder(MapGeometry& geo) : _geo{ geo } {}
+
+    void DecodeBrush(std::string_view content)
+    {
+        FaceTokenizer tok{ content };
+        for (;;) {
+            tok.SkipBlankLines();
+            if (tok.AtEnd()) break;
+
+            char first = tok.Ch();
+            if (first == '(') {
+                if (!DecodeFace(tok)) _geo.invalid_faces++;
+            }
+            else if (first != '/') {
+                // anything but comments is content we don't understand
+                _geo.invalid_faces++;
+            }
+            tok.SkipLine();
+        }
+        _geo.brush_faces.push_back(static_cast<std::uint32_t>(_geo.NumFaces()));
+    }
+
+    bool DecodeFace(FaceTokenizer& tok)
+    {
+        float points[9];
+        for (int i = 0; i < 3; i++) {
+            if (!tok.Expect('(')) return false;
+            if (!tok.Float(points[i*3]) || !tok.Float(points[i*3 + 1]) || !tok.Float(points[i*3 + 2])) return false;
+            if (!tok.Expect(')')) return false;
+        }
+
+        std::string_view texname;
+        if (!tok.Word(texname)) return false;
+
+        float offset[2] = {};
+        float axis_u[4] = {};
+        float axis_v[4] = {};
+        float rot_scale[3];
+        bool valve220 = tok.Expect('[');
+        if (valve220) {
+            if (!tok.Float(axis_u[0]) || !tok.Float(axis_u[1]) || !tok.Float(axis_u[2]) || !tok.Float(axis_u[3])) return false;
+            if (!tok.Expect(']') || !tok.Expect('[')) return false;
+            if (!tok.Float(axis_v[0]) || !tok.Float(axis_v[1]) || !tok.Float(axis_v[2]) || !tok.Float(axis_v[3])) return false;
+            if (!tok.Expect(']')) return false;
+        }
+        else {
+            if (!tok.Float(offset[0]) || !tok.Float(offset[1])) return false;
+        }
+        if (!tok.Float(rot_scale[0]) || !tok.Float(rot_scale[1]) || !tok.Float(rot_scale[2])) return false;
+
+        // Only commit the face once it fully decoded, so the arrays stay the same length.
+        for (int i = 0; i < 9; i++) {
+            _geo.points[i].push_back(points[i]);
+        }
+        _geo.texture.push_back(InternTexture(texname));
+        _geo.offset_x.push_back(offset[0]);
+        _geo.offset_y.push_back(offset[1]);
+        _geo.rotation.push_back(rot_scale[0]);
+        _geo.scale_x.push_back(rot_scale[1]);
+        _geo.scale_y.push_back(rot_scale[2]);
+        for (int i = 0; i < 4; i++) {
+            _geo.axis_u[i].push_back(axis_u[i]);
+            _geo.axis_v[i].push_back(axis_v[i]);
+        }
+        _geo.valve220.push_back(valve220);
+        return true;
+    }
+
+    std::uint32_t InternTexture(std::string_view name)
+    {
+        auto it = _textures.find(name);
+        if (it != _textures.end()) {
+            return it->second;
+        }
+
+        auto id = static_cast<std::uint32_t>(_geo.texture_names.size());
+        _textures.emplace(name, id);
+        _geo.texture_names.push_back(name);
+        return id;
+    }
+
+    MapGeometry& _geo;
+    std::unordered_map<std::string_view, std::uint32_t> _textures;
+};
+
+void DecodeGeometry(const MapFile& map, MapGeometry& geo)
+{
+    // Most brushes are cuboids, reserve for that to avoid regrowing the arrays.
+    std::size_t num_brushes = 0;
+    for (const auto& ent : map._entities) {
+        num_brushes += ent.brush_content.size();
+    }
+    std::size_t num_faces = num_brushes * 6;
+
+    for (auto& arr : geo.points) arr.reserve(num_faces);
+    for (auto& arr : geo.axis_u) arr.reserve(num_faces);
+    for (auto& arr : geo.axis_v) arr.reserve(num_faces);
+    geo.texture.reserve(num_faces);
+    geo.offset_x.reserve(num_faces);
+    geo.offset_y.reserve(num_faces);
+    geo.rotation.reserve(num_faces);
+    geo.scale_x.reserve(num_faces);
+    geo.scale_y.reserve(num_faces);
+    geo.valve220.reserve(num_faces);
+    geo.brush_faces.reserve(num_brushes + 1);
+    geo.entity_brushes.reserve(map._entities.size() + 1);
+
+    GeometryDecoder decoder{ geo };
+    geo.brush_faces.push_back(0);
+    geo.entity_brushes.push_back(0);
+    for (const auto& ent : map._entities) {
+        for (const auto& content : ent.brush_content) {
+            decoder.DecodeBrush(content);
+        }
+        geo.entity_brushes.push_back(static_cast<std::uint32_t>(geo.NumBrushes()));
+    }
+}
+
+static bool IsSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/// One multiply-rotate round per 64-bit word, enough to tell brushes apart and much cheaper per
+/// token than a streaming hash.
+struct TokenMixer
+{
+    void Mix(std::uint64_t v)
+    {
+        _h ^= v * 0xC2B2AE3D27D4EB4Full;
+        _h = ((_h << 31) | (_h >> 33)) * 0x9E3779B185EBCA87ull;
+    }
+
+    void MixBytes(const char* p, std::size_t size)
+    {
+        Mix(size);
+        for (; size >= 8; p += 8, size -= 8) {
+            std::uint64_t v;
+            std::memcpy(&v, p, 8);
+            Mix(v);
+        }
+        // byte by byte, a memcpy of a variable size is a library call
+        std::uint64_t v = 0;
+        for (std::size_t i = 0; i < size; i++) {
+            v |= static_cast<std::uint64_t>(static_cast<unsigned char>(p[i])) << (i * 8);
+        }
+        Mix(v);
+    }
+
+    void MixNumber(double d, double scale)
+    {
+        // Numbers get a tag no string length can have, so "16" the number and "16" the texture differ
+        // from each other but not from "16.0".
+        static constexpr std::uint64_t NUMBER_TAG = ~0ull;
+
+        std::uint64_t bits;
+        double q = d * scale;
+        if (scale > 0.0 && std::fabs(q) < 4.0e15) {
+            // round to the nearest grid step, adding 1.5 * 2^52 leaves no fraction bits
+            q = (q + 6755399441055744.0) - 6755399441055744.0;
+            bits = static_cast<std::uint64_t>(static_cast<std::int64_t>(q));
+        }
+        else {
+            // no epsilon or too large for the grid, compare the exact value
+            double exact = d + 0.0; // -0 becomes 0
+            std::memcpy(&bits, &exact, sizeof(bits));
+        }
+        Mix(NUMBER_TAG);
+        Mix(bits);
+    }
+
+    std::uint64_t Digest() const
+    {
+        std::uint64_t h = _h;
+        h ^= h >> 33;
+        h *= 0xC2B2AE3D27D4EB4Full;
+        h ^= h >> 29;
+        h *= 0x165667B19E3779F9ull;
+        h ^= h >> 32;
+        return h;
+    }
+
+    std::uint64_t _h = 0x27D4EB2F165667C5ull;
+};
+
+std::uint64_t HashBrushCanonical(std::string_view content, double epsilon)
+{
+    const double scale = epsilon > 0.0 ? 1.0 / epsilon : 0.0;
+
+    TokenMixer mixer;
+    const char* p = content.data();
+    const char* end = p + content.size();
+    for (;;) {
+        while (p < end && IsSpace(*p)) p++;
+        if (p == end) break;
+        const char* begin = p;
+
+        char first = *p;
+        bool numeric = (first >= '0' && first <= '9') || first == '-' || first == '+' || first == '.';
+        if (numeric) {
+            // Fast path for plain decimals, exact as long as the mantissa and the power of ten fit in a double.
+            if (first == '-' || first == '+') p++;
+            std::uint64_t mantissa = 0;
+            int digits = 0;
+            int frac_digits = -1;
+            for (; p < end; p++) {
+                char c = *p;
+                if (c >= '0' && c <= '9') {
+                    mantissa = mantissa * 10 + (c - '0');
+                    digits++;
+                    if (frac_digits >= 0) frac_digits++;
+                }
+                else if (c == '.' && frac_digits < 0) {
+                    frac_digits = 0;
+                }
+                else {
+                    break;
+                }
+            }
+            if ((p == end || IsSpace(*p)) && digits > 0 && digits <= 15) {
+                double d = static_cast<double>(mantissa) / POW10[frac_digits > 0 ? frac_digits : 0];
+                mixer.MixNumber(first == '-' ? -d : d, scale);
+                continue;
+            }
+        }
+
+        while (p < end && !IsSpace(*p)) p++;
+        if (p - begin >= 2 && begin[0] == '/' && begin[1] == '/') {
+            while (p < end && *p != '\n') p++;
+            continue;
+        }
+
+        if (numeric) {
+            // exponents and long mantissas
+            double d;
+            auto result = std::from_chars(begin + (first == '+' ? 1 : 0), p, d);
+            if (result.ec == std::errc{} && result.ptr == p) {
+                mixer.MixNumber(d, scale);
+                continue;
+            }
+        }
+        mixer.MixBytes(begin, p - begin);
+    }
+    return mixer.Digest();
+}
+
+/// What qbsp makes of a face by its texture name. Other than these, textures don't change the BSP tree.
+enum TextureContents : std::uint8_t
+{
+    TEXTURE_SOLID,
+    TEXTURE_SKY,
+    TEXTURE_WATER,
+    TEXTURE_SLIME,
+    TEXTURE_LAVA,
+    TEXTURE_CLIP,
+    TEXTURE_SKIP,
+    TEXTURE_HINT,
+    TEXTURE_ORIGIN,
+    TEXTURE_TRIGGER,
+};
+
+static bool StartsWithNoCase(std::string_view str, std::string_view prefix)
+{
+    if (str.size() < prefix.size()) return false;
+    for (std::size_t i = 0; i < prefix.size(); i++) {
+        char c = str[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if (c != prefix[i]) return false;
+    }
+    return true;
+}
+
+static TextureContents GetTextureContents(std::string_view name)
+{
+    // most textures don't start with any of the special letters
+    switch (name.empty() ? 0 : name[0] | 0x20) {
+    case '*':
+        if (StartsWithNoCase(name, "*lava")) return TEXTURE_LAVA;
+        if (StartsWithNoCase(name, "*slime")) return TEXTURE_SLIME;
+        return TEXTURE_WATER;
+    case 's':
+        if (StartsWithNoCase(name, "sky")) return TEXTURE_SKY;
+        if (StartsWithNoCase(name, "skip")) return TEXTURE_SKIP;
+        break;
+    case 'c':
+        if (StartsWithNoCase(name, "clip")) return TEXTURE_CLIP;
+        break;
+    case 'h':
+        if (StartsWithNoCase(name, "hint")) return TEXTURE_HINT;
+        break;
+    case 'o':
+        if (StartsWithNoCase(name, "origin")) return TEXTURE_ORIGIN;
+        break;
+    case 't':
+        if (StartsWithNoCase(name, "trigger")) return TEXTURE_TRIGGER;
+        break;
+    }
+    return TEXTURE_SOLID;
+}
+
+std::uint64_t HashBrushShape(std::string_view content, double epsilon)
+{
+    const double scale = epsilon > 0.0 ? 1.0 / epsilon : 0.0;
+
+    TokenMixer mixer;
+    FaceTokenizer tok{ content };
+    for (;;) {
+        tok.SkipBlankLines();
+        if (tok.AtEnd()) break;
+
+        const char* line = tok._p;
+        if (tok.Ch() == '/') {
+            tok.SkipLine();
+            continue;
+        }
+
+        double points[9];
+        std::string_view texname;
+        bool face = true;
+        for (int i = 0; i < 3 && face; i++) {
+            face = tok.Expect('(') && tok.Number(points[i*3]) && tok.Number(points[i*3 + 1]) && tok.Number(points[i*3 + 2]) && tok.Expect(')');
+        }
+        face = face && tok.Word(texname);
+        tok.SkipLine();
+
+        if (face) {
+            for (double d : points) {
+                mixer.MixNumber(d, scale);
+            }
+            mixer.Mix(GetTextureContents(texname));
+        }
+        else {
+            // content we don't understand counts as it is
+            mixer.MixBytes(line, tok._p - line);
+        }
+    }
+    return mixer.Digest();
+}
+
+bool MapBounds::Contains(const std::array<double, 3>& point) const
+{
+    for (int axis = 0; axis < 3; axis++) {
+        if (point[axis] < mins[axis] || point[axis] > maxs[axis]) return false;
+    }
+    return true;
+}
+
+bool MapBounds::Intersects(const MapBounds& other) const
+{
+    for (int axis = 0; axis < 3; axis++) {
+        if (other.maxs[axis] < mins[axis] || other.mins[axis] > maxs[axis]) return false;
+    }
+    return true;
+}
+
+typedef std::array<double, 3> Vec3;
+
+static Vec3 Cross(const Vec3& a, const Vec3& b)
+{
+    return { a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+}
+
+static double Dot(const Vec3& a, const Vec3& b)
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+bool GetBrushBounds(const MapGeometry& geo, std::size_t brush, MapBounds& bounds)
+{
+    static constexpr double ON_PLANE_EPSILON = 0.01;
+
+    struct Plane
+    {
+        Vec3 normal;
+        double dist;
+    };
+
+    // Same as qbsp: the normal is (p0 - p1) x (p2 - p1) and points out of the brush
+    std::vector<Plane> planes;
+    for (std::uint32_t f = geo.brush_faces[brush]; f < geo.brush_faces[brush + 1]; f++) {
+        Vec3 p[3];
+        for (int i = 0; i < 3; i++) {
+            p[i] = { geo.points[i*3][f], geo.points[i*3 + 1][f], geo.points[i*3 + 2][f] };
+        }
+        Vec3 normal = Cross({ p[0][0] - p[1][0], p[0][1] - p[1][1], p[0][2] - p[1][2] }, { p[2][0] - p[1][0], p[2][1] - p[1][1], p[2][2] - p[1][2] });
+        double length = std::sqrt(Dot(normal, normal));
+        if (length == 0.0) continue;
+        normal = { normal[0] / length, normal[1] / length, normal[2] / length };
+        planes.push_back(Plane{ normal, Dot(normal, p[1]) });
+    }
+
+    // The corners are where three planes meet without being in front of any other
+    bool found = false;
+    for (std::size_t i = 0; i < planes.size(); i++) {
+        for (std::size_t j = i + 1; j < planes.size(); j++) {
+            for (std::size_t k = j + 1; k < planes.size(); k++) {
+                const Plane& a = planes[i];
+                const Plane& b = planes[j];
+                const Plane& c = planes[k];
+                Vec3 bc = Cross(b.normal, c.normal);
+                double det = Dot(a.normal, bc);
+                if (std::fabs(det) < 1e-9) continue;
+
+                Vec3 ca = Cross(c.normal, a.normal);
+                Vec3 ab = Cross(a.normal, b.normal);
+                Vec3 corner;
+                for (int axis = 0; axis < 3; axis++) {
+                    corner[axis] = (a.dist * bc[axis] + b.dist * ca[axis] + c.dist * ab[axis]) / det;
+                }
+
+                bool inside = true;
+                for (const Plane& plane : planes) {
+                    if (Dot(plane.normal, corner) - plane.dist > ON_PLANE_EPSILON) {
+                        inside = false;
+                        break;
+                    }
+                }
+                if (!inside) continue;
+
+                if (!found) {
+                    bounds.mins = corner;
+                    bounds.maxs = corner;
+                    found = true;
+                }
+                for (int axis = 0; axis < 3; axis++) {
+                    bounds.mins[axis] = std::min(bounds.mins[axis], corner[axis]);
+                    bounds.maxs[axis] = std::max(bounds.maxs[axis], corner[axis]);
+                }
+            }
+        }
+    }
+    return found;
+}
+
+std::string_view FindSealTexture(const MapGeometry& geo)
+{
+    std::vector<std::uint32_t> uses(geo.texture_names.size());
+    for (std::uint32_t texture : geo.texture) {
+        uses[texture]++;
+    }
+
+    std::string_view best;
+    std::uint32_t best_uses = 0;
+    for (std::size_t i = 0; i < geo.texture_names.size(); i++) {
+        TextureContents contents = GetTextureContents(geo.texture_names[i]);
+        if (contents == TEXTURE_SKY) {
+            return geo.texture_names[i];
+        }
+        if (contents == TEXTURE_SOLID && uses[i] > best_uses) {
+            best = geo.texture_names[i];
+            best_uses = uses[i];
+        }
+    }
+    return best;
+}
+
+}
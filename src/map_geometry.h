@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace map_file {
+
+struct MapFile;
+
+/// Brush faces of a whole map decoded into structure-of-arrays storage.
+/// Brushes are numbered in file order across all entities.
+struct MapGeometry
+{
+    // Brushes of entity i are [entity_brushes[i], entity_brushes[i+1]).
+    std::vector<std::uint32_t> entity_brushes;
+
+    // Faces of brush i are [brush_faces[i], brush_faces[i+1]).
+    std::vector<std::uint32_t> brush_faces;
+
+    // Per face: the three plane points as p0.x, p0.y, p0.z, p1.x ... p2.z.
+    std::array<std::vector<float>, 9> points;
+
+    // Per face: index into texture_names.
+    std::vector<std::uint32_t> texture;
+
+    // Per face: texture alignment. Standard faces store their offsets in offset_x/offset_y,
+    // Valve 220 faces store them in axis_u[3]/axis_v[3] and leave offset_x/offset_y zeroed.
+    std::vector<float> offset_x;
+    std::vector<float> offset_y;
+    std::vector<float> rotation;
+    std::vector<float> scale_x;
+    std::vector<float> scale_y;
+
+    // Per face: Valve 220 texture axes and offsets, zeroed for standard faces.
+    std::array<std::vector<float>, 4> axis_u;
+    std::array<std::vector<float>, 4> axis_v;
+    std::vector<std::uint8_t> valve220;
+
+    std::vector<std::string_view> texture_names;
+
+    // Brush content that couldn't be decoded as faces, counted per map.
+    std::size_t invalid_faces = 0;
+
+    std::size_t NumBrushes() const { return brush_faces.empty() ? 0 : brush_faces.size() - 1; }
+
+    std::size_t NumFaces() const { return texture.size(); }
+};
+
+void DecodeGeometry(const MapFile& map, MapGeometry& geo);
+
+/// Axis-aligned box in map units.
+struct MapBounds
+{
+    std::array<double, 3> mins;
+    std::array<double, 3> maxs;
+
+    bool Contains(const std::array<double, 3>& point) const;
+
+    bool Intersects(const MapBounds& other) const;
+};
+
+/// Bounds of brush i from the corners where its planes meet, the planes facing out of the brush as
+/// qbsp reads them. Returns false if they don't enclose a volume.
+bool GetBrushBounds(const MapGeometry& geo, std::size_t brush, MapBounds& bounds);
+
+/// A sky texture the map uses, or else the solid texture on most of its faces, so brushes added to
+/// the map can use a texture its wads are sure to have. Empty if the map has no faces.
+std::string_view FindSealTexture(const MapGeometry& geo);
+
+/// Hashes the tokens of a brush instead of its text: whitespace and comments don't count, and
+/// numbers are rounded to multiples of epsilon, so "16", "16.0" and "16.0001" hash the same with
+/// an epsilon of 0.001. With an epsilon of 0 numbers only have to be equal, not written the same.
+/// Rounding puts a boundary between every two grid steps, so two values closer than epsilon can
+/// still land on different sides of it.
+std::uint64_t HashBrushCanonical(std::string_view content, double epsilon);
+
+/// Hashes the planes of a brush like HashBrushCanonical, and of its textures only what qbsp makes of
+/// them: sky, liquids, clip, skip, hint and the like. Brushes that only differ in texture names and
+/// alignment have the same shape and give the same BSP tree.
+std::uint64_t HashBrushShape(std::string_view content, double epsilon);
+
+}
@@ -0,0 +1,183 @@
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include "hash.h"
+#include "map_snapshot.h"
+#include "path.h"
+
+namespace map_snapshot {
+
+struct SnapshotHeader
+{
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t bsp_modified_time;
+    std::uint64_t bsp_size;
+    std::uint64_t payload_size;
+    std::uint64_t payload_hash;
+
+    // Hash of all the members above, checked before anything else is trusted.
+    std::uint64_t header_hash;
+};
+
+static const char SNAPSHOT_MAGIC[4] = { 'Q', '1', 'C', 'S' };
+
+static std::uint64_t HashHeader(const SnapshotHeader& header)
+{
+    return hash::Hash(std::string_view(reinterpret_cast<const char*>(&header), offsetof(SnapshotHeader, header_hash)));
+}
+
+MapSnapshot MakeSnapshot(const map_file::MapFile& map, const std::string& map_path, const map_file::MapDiffOptions& options,
+    const map_file::MapLayerFilter* filter)
+{
+    MapSnapshot snap;
+    snap.map_path = map_path;
+    auto digests = map.GetDigests(options, filter);
+    snap.options_hash = digests.options_hash;
+    snap.brush_hash = digests.brushes;
+    snap.entity_hash = digests.entities;
+    snap.light_hash = digests.lights;
+    snap.shape_hash = digests.shapes;
+    return snap;
+}
+
+static map_file::MapDigests GetDigests(const MapSnapshot& snap)
+{
+    return map_file::MapDigests{ snap.options_hash, snap.brush_hash, snap.entity_hash, snap.light_hash, snap.shape_hash };
+}
+
+map_file::MapDiffFlags GetDiffFlags(const MapSnapshot& a, const MapSnapshot& b)
+{
+    return map_file::GetDiffFlags(GetDigests(a), GetDigests(b));
+}
+
+bool IsSnapshotCurrent(const MapSnapshot& snap, const std::string& map_path, unsigned long long bsp_modified_time, std::uint64_t bsp_size)
+{
+    return snap.map_path == map_path && snap.bsp_modified_time == bsp_modified_time && snap.bsp_size == bsp_size;
+}
+
+std::string GetSnapshotFilename(const std::string& map_path)
+{
+    char name[64];
+    std::snprintf(name, sizeof(name), "q1compile_%016llx.snapshot", (unsigned long long)hash::Hash(map_path));
+    return name;
+}
+
+struct PayloadWriter
+{
+    void U32(std::uint32_t v) { _data.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+    void U64(std::uint64_t v) { _data.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+    void String(const std::string& str) { U32(static_cast<std::uint32_t>(str.size())); _data.append(str); }
+
+    std::string _data;
+};
+
+struct PayloadReader
+{
+    bool Read(void* out, std::size_t size)
+    {
+        if (_data.size() - _offs < size) {
+            _good = false;
+            return false;
+        }
+        std::memcpy(out, _data.data() + _offs, size);
+        _offs += size;
+        return true;
+    }
+
+    std::uint32_t U32() { std::uint32_t v = 0; Read(&v, sizeof(v)); return v; }
+    std::uint64_t U64() { std::uint64_t v = 0; Read(&v, sizeof(v)); return v; }
+
+    std::string String()
+    {
+        std::uint32_t size = U32();
+        if (!_good || _data.size() - _offs < size) {
+            _good = false;
+            return {};
+        }
+        std::string str = _data.substr(_offs, size);
+        _offs += size;
+        return str;
+    }
+
+    const std::string& _data;
+    std::size_t _offs = 0;
+    bool _good = true;
+};
+
+bool WriteSnapshot(const std::string& path, const MapSnapshot& snap)
+{
+    PayloadWriter payload;
+    payload.String(snap.map_path);
+    payload.U64(snap.options_hash);
+    payload.U64(snap.brush_hash);
+    payload.U64(snap.entity_hash);
+    payload.U64(snap.light_hash);
+    payload.U64(snap.shape_hash);
+    payload.U64(snap.work_map_hash);
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.bsp_modified_time = snap.bsp_modified_time;
+    header.bsp_size = snap.bsp_size;
+    header.payload_size = payload._data.size();
+    header.payload_hash = hash::Hash(payload._data);
+    header.header_hash = HashHeader(header);
+
+    std::FILE* const fh = path::OpenFile(path, "wb");
+    if (!fh) {
+        return false;
+    }
+
+    bool written = std::fwrite(&header, sizeof(header), 1, fh) == 1
+        && std::fwrite(payload._data.data(), 1, payload._data.size(), fh) == payload._data.size();
+    return (std::fclose(fh) == 0) && written;
+}
+
+bool ReadSnapshot(const std::string& path, MapSnapshot& snap)
+{
+    std::FILE* const fh = path::OpenFile(path, "rb");
+    if (!fh) {
+        return false;
+    }
+
+    SnapshotHeader header;
+    bool header_good = std::fread(&header, sizeof(header), 1, fh) == 1
+        && !std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))
+        && header.version == SNAPSHOT_VERSION
+        && header.header_hash == HashHeader(header);
+    if (!header_good) {
+        std::fclose(fh);
+        return false;
+    }
+
+    std::string data(header.payload_size, '\0');
+    std::size_t read = std::fread(&data[0], 1, data.size(), fh);
+    std::fclose(fh);
+    if (read != data.size() || hash::Hash(data) != header.payload_hash) {
+        return false;
+    }
+
+    MapSnapshot result;
+    result.bsp_modified_time = header.bsp_modified_time;
+    result.bsp_size = header.bsp_size;
+
+    PayloadReader payload{ data };
+    result.map_path = payload.String();
+    result.options_hash = payload.U64();
+    result.brush_hash = payload.U64();
+    result.entity_hash = payload.U64();
+    result.light_hash = payload.U64();
+    result.shape_hash = payload.U64();
+    result.work_map_hash = payload.U64();
+    if (!payload._good) {
+        return false;
+    }
+
+    snap = std::move(result);
+    return true;
+}
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "map_file.h"
+
+namespace map_snapshot {
+
+static constexpr std::uint32_t SNAPSHOT_VERSION = 8;
+
+/// What a map looked like the last time it was compiled successfully. It's saved in the work dir,
+/// so the first compile of a session can be diffed too.
+struct MapSnapshot
+{
+    std::string map_path;
+
+    // The output BSP built from this map, if it changes the snapshot no longer describes it.
+    unsigned long long bsp_modified_time = 0;
+    std::uint64_t bsp_size = 0;
+
+    // MapDigests of the map.
+    std::uint64_t options_hash = 0;
+    std::uint64_t brush_hash = 0;
+    std::uint64_t entity_hash = 0;
+    std::uint64_t light_hash = 0;
+    std::uint64_t shape_hash = 0;
+
+    // Hash of the normalized work map it was compiled from, 0 if the work map wasn't normalized.
+    std::uint64_t work_map_hash = 0;
+};
+
+/// With a filter, the digests are those of the part of the map it keeps, see MapFile::GetDigests.
+MapSnapshot MakeSnapshot(const map_file::MapFile& map, const std::string& map_path, const map_file::MapDiffOptions& options,
+    const map_file::MapLayerFilter* filter = nullptr);
+
+/// Snapshots made with different diff options can't be compared, everything counts as changed then.
+map_file::MapDiffFlags GetDiffFlags(const MapSnapshot& a, const MapSnapshot& b);
+
+/// Whether the snapshot still describes the given map and the output BSP as it is on disk.
+bool IsSnapshotCurrent(const MapSnapshot& snap, const std::string& map_path, unsigned long long bsp_modified_time, std::uint64_t bsp_size);
+
+/// Snapshot file name, keyed by the map source path.
+std::string GetSnapshotFilename(const std::string& map_path);
+
+bool WriteSnapshot(const std::string& path, const MapSnapshot& snap);
+
+/// Fails if the file is missing, from another version or corrupt.
+bool ReadSnapshot(const std::string& path, MapSnapshot& snap);
+
+}
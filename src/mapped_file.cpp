@@ -0,0 +1,117 @@
+#include <cstdio>
+#include "mapped_file.h"
+
+#if defined(_WIN32)
+#include "common.h"
+#include "path.h"
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_FILE_POSIX 1
+#endif
+
+namespace mapped_file {
+
+#if defined(_WIN32)
+
+// A mapped view would keep the editor from truncating the map when it saves over it
+// (mapped files can't be truncated on Windows) and the MapFile is held for a long time,
+// so read the whole file into a single owned buffer instead.
+MappedFile::MappedFile(const std::string& path)
+{
+    HANDLE file = CreateFileW(path::Widen(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    common::ScopeGuard close_file{ [file]() { CloseHandle(file); } };
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || size.QuadPart > MAXDWORD) {
+        return;
+    }
+
+    char* buf = new char[static_cast<std::size_t>(size.QuadPart)];
+    DWORD read = 0;
+    if (!ReadFile(file, buf, static_cast<DWORD>(size.QuadPart), &read, NULL) || read == 0) {
+        delete[] buf;
+        return;
+    }
+
+    _data = buf;
+    _size = read;
+    _handle = buf;
+}
+
+MappedFile::~MappedFile()
+{
+    delete[] static_cast<char*>(_handle);
+}
+
+#elif defined(MAPPED_FILE_POSIX)
+
+MappedFile::MappedFile(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    void* data = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+    madvise(data, static_cast<std::size_t>(st.st_size), MADV_SEQUENTIAL);
+
+    _data = static_cast<const char*>(data);
+    _size = static_cast<std::size_t>(st.st_size);
+}
+
+MappedFile::~MappedFile()
+{
+    if (_data) munmap(const_cast<char*>(_data), _size);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path)
+{
+    std::FILE* const fh = std::fopen(path.c_str(), "rb");
+    if (!fh) {
+        return;
+    }
+
+    std::fseek(fh, 0, SEEK_END);
+    long size = std::ftell(fh);
+    std::rewind(fh);
+    if (size <= 0) {
+        std::fclose(fh);
+        return;
+    }
+
+    char* buf = new char[size];
+    std::size_t read = std::fread(buf, 1, size, fh);
+    std::fclose(fh);
+
+    _data = buf;
+    _size = read;
+    _handle = buf;
+}
+
+MappedFile::~MappedFile()
+{
+    delete[] static_cast<char*>(_handle);
+}
+
+#endif
+
+}
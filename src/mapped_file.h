@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace mapped_file {
+
+/// Read-only view of a whole file, memory-mapped where the platform supports it
+/// and read into a single owned buffer otherwise. The view stays valid for the
+/// lifetime of the MappedFile.
+struct MappedFile
+{
+    explicit MappedFile(const std::string& path);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile& operator =(const MappedFile&) = delete;
+
+    bool Good() const { return _data != nullptr; }
+
+    std::string_view View() const { return std::string_view{ _data, _size }; }
+
+    const char* _data = nullptr;
+    std::size_t _size = 0;
+    void* _handle = nullptr;
+};
+
+}
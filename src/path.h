@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdio>
 #include <string>
 
 namespace path {
@@ -46,4 +47,14 @@ unsigned long long GetFileModifiedTime(const std::string& path);
 
 std::size_t GetFileSize(const std::string& path);
 
+/// std::fopen for UTF-8 paths. Inline, the map and BSP code is built without the rest of this file.
+inline std::FILE* OpenFile(const std::string& path, const char* mode)
+{
+#ifdef _WIN32
+    return _wfopen(Widen(path).c_str(), Widen(mode).c_str());
+#else
+    return std::fopen(path.c_str(), mode);
+#endif
+}
+
 }
\ No newline at end of file
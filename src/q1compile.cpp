@@ -218,10 +218,9 @@ static void HandleMapSourceChanged()
     const std::string& path = g_app->current_config->config.config_paths[config::PATH_MAP_SOURCE];
     g_app->current_config->map_file_watcher->SetPath(path);
     g_app->current_config->map_file_watcher->SetEnabled(g_app->current_config->config.watch_map_file);
-    g_app->current_config->map_file = std::make_unique<map_file::MapFile>(path);
-    if (!g_app->current_config->map_file->Good()) {
-        g_app->current_config->map_file = nullptr;
-    }
+    g_app->current_config->map_file = nullptr;
+    g_app->current_config->map_layers = nullptr;
+    compile::LoadMapSnapshot(g_app->current_config);
 }
 
 static void SetConfigPath(config::ConfigPath path, const std::string& value)
@@ -346,6 +345,7 @@ static void AddNewConfig()
     state.config.config_paths[config::PATH_TOOLS_DIR] = g_app->user_config.last_tools_dir;
     state.config.config_paths[config::PATH_ENGINE_EXE] = g_app->user_config.last_engine_exe;
     state.config.steps = config::GetDefaultCompileSteps();
+    compile::BuildMapDiffOptions(&state);
 
     SetCurrentConfigAndSelect(g_app->open_configs.size() - 1);
 }
@@ -405,11 +405,12 @@ static bool LoadConfig(const std::string& path)
     state.modified_steps = false;
     state.map_has_leak = false;
     state.map_file_watcher = std::make_unique<file_watcher::FileWatcher>("", WATCH_MAP_FILE_INTERVAL);
+    compile::BuildMapDiffOptions(&state);
 
     auto& mapsrc = state.config.config_paths[config::PATH_MAP_SOURCE];
     if (!mapsrc.empty()) {
-        state.map_file = std::make_unique<map_file::MapFile>(mapsrc);
         state.map_file_watcher->SetPath(mapsrc);
+        compile::LoadMapSnapshot(&state);
     }
 
     SetCurrentConfigAndSelect(g_app->open_configs.size() - 1);
@@ -683,11 +684,22 @@ static void HandleAutoCompile(OpenConfigState* state)
         console::PrintError("Please fix errors above to be able to compile.");
     }
     else {
-        // don't run quake and don't ignore diff
+        // don't run quake and don't ignore diff, the map is parsed while the job waits for the editor
+        compile::StartPreParse(state);
         compile::StartCompileJob(state, compile::CF_NONE);
     }
 }
 
+static void HandleBuildLayerVariants()
+{
+    if (!ValidateToCompile()) {
+        console::PrintError("Please fix errors above to be able to compile.\n\n");
+    }
+    else {
+        compile::StartLayerVariantsJob(g_app->current_config);
+    }
+}
+
 static void HandleStopCompiling()
 {
     if (g_app->compiling) {
@@ -1263,6 +1275,10 @@ static void DrawMenuBar()
                 g_app->show_layers_window = true;
             }
 
+            if (ImGui::MenuItem("Build layer variants", "", nullptr)) {
+                HandleBuildLayerVariants();
+            }
+
             ImGui::EndMenu();
         }
 
@@ -1374,9 +1390,9 @@ static void DrawLayerSelectionCombo()
     }
 
     if (ImGui::BeginCombo("##layers", selected_layers_name)) {
-        if (ImGui::Selectable("All (default)", false)) {
-            //g_app->current_config->selected_preset_index = 0;
-            //CopyPreset({});
+        if (ImGui::Selectable("All (default)", selected_index == -1)) {
+            g_app->current_config->config.selected_layers.clear();
+            g_app->current_config->modified = true;
         }
 
         for (std::size_t i = 0; i < g_app->current_config->config.layer_selections.size(); i++) {
@@ -1406,6 +1422,44 @@ static void DrawMapOptions()
 
     DrawSpacing (0, 5);
 
+    if (ImGui::Checkbox("Compile a region", &g_app->current_config->config.region_enabled)) {
+        g_app->current_config->modified = true;
+    }
+    ImGui::SameLine();
+    DrawHelpMarker(
+        "Only compile the brushes and entities in a box, sealed with the map's sky texture (or its most used one) so it doesn't leak, "
+        "and with a player start in the middle if there's none in it. The output BSP is the region then, "
+        "the next compile of the whole map runs every step."
+    );
+
+    if (g_app->current_config->config.region_enabled) {
+        float spacing = ImGui::GetTreeNodeToLabelSpacing();
+        DrawSpacing(spacing, 0); ImGui::SameLine();
+        if (DrawTextInput("Entity:", g_app->current_config->config.region_entity, 0, 0,
+            "Targetname of the entity to compile the region around, its bounds grow by the margin. Leave empty to use the box.")) {
+            g_app->current_config->modified = true;
+        }
+        DrawSpacing(spacing, 0); ImGui::SameLine();
+        if (DrawTextInput("Box:", g_app->current_config->config.region_box, 14.0f, 0, "Two corners of the region, \"x1 y1 z1 x2 y2 z2\".")) {
+            g_app->current_config->modified = true;
+        }
+        DrawSpacing(spacing, 0); ImGui::SameLine();
+        ImGui::Text("Margin:"); ImGui::SameLine();
+        ImGui::SetNextItemWidth(100.0f);
+        if (ImGui::InputDouble("##region_margin", &g_app->current_config->config.region_margin, 16, 64, "%.0f")) {
+            g_app->current_config->modified = true;
+        }
+    }
+
+    if (ImGui::Checkbox("Strip editor metadata from the work map", &g_app->current_config->config.normalize_work_map)) {
+        g_app->current_config->modified = true;
+    }
+    ImGui::SameLine();
+    DrawHelpMarker(
+        "Leave TrenchBroom's _tb_* fields, comments and plain groups out of the map the tools read. "
+        "A save that only changes those (renaming a group, hiding a layer) finishes without compiling."
+    );
+
     DrawSpacing(0, 5.0f);
 
     if (ImGui::Checkbox("Watch map file for changes and pre-compile", &g_app->current_config->config.watch_map_file)) {
@@ -1428,6 +1482,27 @@ static void DrawMapOptions()
             "If a light changes, it will apply -onlyents to QBSP. "
             "If only point entities changes, it will apply -onlyents to both QBSP and LIGHT. "
         );
+
+        if (g_app->current_config->config.auto_apply_onlyents) {
+            DrawSpacing(spacing * 2, 0); ImGui::SameLine();
+            if (ImGui::Checkbox("Patch the entity lump without QBSP", &g_app->current_config->config.patch_entity_lump)) {
+                g_app->current_config->modified = true;
+            }
+            ImGui::SameLine();
+            DrawHelpMarker(
+                "If only point entities change, write the new entities straight into the BSP instead of running QBSP -onlyents. "
+                "Maps with rotate_* or misc_external_map entities still use QBSP."
+            );
+
+            if (g_app->current_config->config.patch_entity_lump) {
+                DrawSpacing(spacing * 2, 0); ImGui::SameLine();
+                if (ImGui::Checkbox("Verify against QBSP -onlyents", &g_app->current_config->config.verify_entity_lump)) {
+                    g_app->current_config->modified = true;
+                }
+                ImGui::SameLine();
+                DrawHelpMarker("Also run QBSP -onlyents on a copy and report any difference, QBSP's entities are used if they differ.");
+            }
+        }
     }
 
     DrawSpacing(0, 5.0f);
@@ -1803,7 +1878,7 @@ static int DrawPresetListItem(config::ToolPreset& preset, int index)
 static int FindLayerIndex(std::string_view name)
 {
     int idx = 0;
-    for (const auto& layer : g_app->current_config->map_file->_layers) {
+    for (const auto& layer : *g_app->current_config->map_layers) {
         if (layer.name == name) {
             return idx;
         }
@@ -1812,12 +1887,34 @@ static int FindLayerIndex(std::string_view name)
     return -1;
 }
 
+static void ReadMapLayers(OpenConfigState* state)
+{
+    const std::string& path = state->config.config_paths[config::PATH_MAP_SOURCE];
+    auto layers = std::make_unique<std::vector<map_file::MapLayer>>();
+    if (path.empty() || !map_file::ReadMapLayers(path, *layers)) {
+        console::PrintError("Could not read the layers of the map source file.\n");
+        layers = nullptr;
+    }
+    state->map_layers = std::move(layers);
+}
+
 static void DrawLayerSelectionWindow()
 {
-    if (!g_app->current_config->map_file.get() || !g_app->current_config->map_file->Good()) { return; }
+    // The map may have new layers since the window was last open
+    static bool prev_show;
+    bool opened = g_app->show_layers_window && !prev_show;
+    prev_show = g_app->show_layers_window;
+    if (opened) {
+        ReadMapLayers(g_app->current_config);
+    }
+    if (!g_app->current_config->map_layers) {
+        g_app->show_layers_window = false;
+        prev_show = false;
+        return;
+    }
 
     static std::vector<int> selected{};
-    selected.resize(g_app->current_config->map_file->_layers.size());
+    selected.resize(g_app->current_config->map_layers->size());
 
     auto DrawLayerSelection = [](config::LayerSelection& sel, bool builtin)
     {
@@ -1832,7 +1929,10 @@ static void DrawLayerSelectionWindow()
         std::memset(selected.data(), 0, selected.size() * sizeof(int));
         for (const auto& lname : sel.layers) {
             int idx = FindLayerIndex(lname);
-            selected[idx] = 1;
+            if (idx >= 0) {
+                // the layer may have been removed from the map
+                selected[idx] = 1;
+            }
         }
 
         if (!builtin) {
@@ -1860,6 +1960,13 @@ static void DrawLayerSelectionWindow()
             }
             ImGui::SameLine();
             DrawHelpMarker("When a new layer is created, automatically add to this selection.");
+            ImGui::SameLine();
+            ImGui::Text(" | "); ImGui::SameLine();
+            if (ImGui::Checkbox("Build as variant", &sel.build_variant)) {
+                g_app->current_config->modified = true;
+            }
+            ImGui::SameLine();
+            DrawHelpMarker("'Compile -> Build layer variants' builds the selections marked as variants at the same time, or all of them if none is. Each one goes to its own output BSP, named after the map and the selection.");
         }
 
         ImGui::PushStyleColor(ImGuiCol_ChildBg, INPUT_TEXT_READ_ONLY_COLOR);
@@ -1874,7 +1981,7 @@ static void DrawLayerSelectionWindow()
             ImGui::NextColumn();
             
             int idx = 1;
-            for (const auto& layer : g_app->current_config->map_file->_layers) {
+            for (const auto& layer : *g_app->current_config->map_layers) {
                 if (ImGui::Selectable(layer.name.c_str(), (bool*)&selected[idx-1])) {
                     g_app->current_config->modified = true;
                 }
@@ -1890,17 +1997,15 @@ static void DrawLayerSelectionWindow()
 
         sel.layers.clear();
         for (int i = 0; i < selected.size(); i++) {
-            const auto& layer = g_app->current_config->map_file->_layers[i];
+            const auto& layer = (*g_app->current_config->map_layers)[i];
             if (selected[i]) {
                 sel.layers.push_back(layer.name);
             }
         }
     };
 
-    static bool prev_show;
-
     if (g_app->show_layers_window) {
-        if (!prev_show) {
+        if (opened) {
             ImGui::OpenPopup("Manage Layer Selections");
         }
 
@@ -1919,7 +2024,7 @@ static void DrawLayerSelectionWindow()
                 sel.name = "New Layer Selection";
                 sel.auto_select_new_layers = true;
                 sel.default_layer_selected = true;
-                for (const auto& layer : g_app->current_config->map_file->_layers) {
+                for (const auto& layer : *g_app->current_config->map_layers) {
                     sel.layers.push_back(layer.name);
                 }
                 g_app->current_config->config.layer_selections.push_back(sel);
@@ -1937,7 +2042,7 @@ static void DrawLayerSelectionWindow()
                     sel.auto_select_new_layers = true;
                     sel.default_layer_selected = true;
                     sel.name = "All (default)";
-                    for (const auto& layer : g_app->current_config->map_file->_layers) {
+                    for (const auto& layer : *g_app->current_config->map_layers) {
                         sel.layers.push_back(layer.name);
                     }
                     DrawLayerSelection(sel, true);
@@ -1970,8 +2075,6 @@ static void DrawLayerSelectionWindow()
             ImGui::EndPopup();
         }
     }
-
-    prev_show = g_app->show_layers_window;
 }
 
 static void DrawPresetWindow()
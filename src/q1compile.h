@@ -2,9 +2,11 @@
 
 #include "common.h"
 #include "console.h"
+#include "compile.h"
 #include "config.h"
 #include "file_watcher.h"
 #include "map_file.h"
+#include "map_snapshot.h"
 #include "mutex_char_buffer.h"
 #include "path.h"
 #include "work_queue.h"
@@ -44,8 +46,21 @@ struct OpenConfigState {
     // 1-based index of override preset (in case of keybind command).
     int kb_override_preset_index;
 
-    std::unique_ptr<map_file::MapFile>              map_file;
+    // The last map compiled, kept for its mod when running Quake.
+    std::shared_ptr<map_file::MapFile>              map_file;
+    // Layers of the map source, streamed in with map_file::ReadMapLayers when the layer selections
+    // window opens. Null if the map couldn't be read.
+    std::unique_ptr<std::vector<map_file::MapLayer>> map_layers;
+    map_file::MapDiffOptions                        diff_options;
+    // What the output BSP was built from, the map and its snapshot as of the last compile that ran
+    // every step successfully. The baseline map is only kept for compiles of this session, and is
+    // shared with the background parse, only access it with std::atomic_load and std::atomic_store.
+    std::shared_ptr<const map_file::MapFile>        baseline_map;
+    std::unique_ptr<map_snapshot::MapSnapshot>      map_snapshot;
     std::unique_ptr<file_watcher::FileWatcher>      map_file_watcher;
+    // Set by compile::StartPreParse, taken by the next compile job. Only access it with
+    // std::atomic_load and std::atomic_exchange.
+    std::shared_ptr<compile::PreParsedMap>          pre_parsed_map;
     std::atomic_bool                                map_has_leak = false;
 };
 
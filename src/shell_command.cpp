@@ -12,7 +12,19 @@ ShellCommand::ShellCommand(const std::string& cmd, const std::string& pwd)
 
 ShellCommand::~ShellCommand()
 {
-    _pclose(handle);
+    if (handle) {
+        _pclose(handle);
+    }
+}
+
+int ShellCommand::Close()
+{
+    if (!handle) {
+        return -1;
+    }
+    int status = _pclose(handle);
+    handle = NULL;
+    return status;
 }
 
 bool ShellCommand::Good() const { return handle != NULL; }
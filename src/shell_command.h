@@ -14,6 +14,9 @@ struct ShellCommand
 
     bool ReadChar(char& c);
 
+    /// Waits for the command to exit and returns its exit status, -1 if it couldn't be waited on.
+    int Close();
+
     FILE* handle;
 };
 
@@ -82,6 +82,12 @@ struct SubProcess {
         return bSuccess && (dwRead == 1);
     }
 
+    bool Wait(DWORD& exit_code) {
+        return good
+            && (WaitForSingleObject(pi.hProcess, INFINITE) == WAIT_OBJECT_0)
+            && GetExitCodeProcess(pi.hProcess, &exit_code);
+    }
+
     ~SubProcess() {
         CloseHandle(inputHandleWrite);
         CloseHandle(outputHandleRead);
@@ -127,6 +133,16 @@ bool SubProcess::Good()
     return static_cast<native_impl::SubProcess*>(handle)->good;
 }
 
+bool SubProcess::Wait(unsigned long& exit_code)
+{
+    DWORD code = 0;
+    if (!static_cast<native_impl::SubProcess*>(handle)->Wait(code)) {
+        return false;
+    }
+    exit_code = code;
+    return true;
+}
+
 bool StartDetachedProcess(const std::string& cmd, const std::string& pwd)
 {
     STARTUPINFOA si;
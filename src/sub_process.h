@@ -14,6 +14,9 @@ struct SubProcess
 
     bool Good();
 
+    /// Waits for the process to exit. Returns false if it couldn't be waited on.
+    bool Wait(unsigned long& exit_code);
+
     void* handle;
 };
 